@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT       += core gui network websockets
+QT       += core gui network websockets concurrent
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
@@ -20,7 +20,8 @@ SOURCES += main.cpp \
     calibrationtools.cpp \
     mpfit/mpfit.cpp \
     calibrationdata.cpp \
-    calibrationserver.cpp
+    calibrationserver.cpp \
+    calibrationbenchmark.cpp
 
 HEADERS  += \
     screencalibration.h \
@@ -30,10 +31,25 @@ HEADERS  += \
     calibrationtools.h \
     mpfit/mpfit.h \
     calibrationdata.h \
-    calibrationserver.h
+    calibrationserver.h \
+    calibrationbenchmark.h \
+    lmsolver.h
 
 #FORMS    +=
 
+win32: LIBS += -lws2_32
+
+# qmake CONFIG+=openmp lets mpfit compute finite-difference Jacobians on
+# several threads (mp_config.nthreads)
+openmp {
+    msvc {
+        QMAKE_CXXFLAGS += -openmp
+    } else {
+        QMAKE_CXXFLAGS += -fopenmp
+        QMAKE_LFLAGS += -fopenmp
+    }
+}
+
 win32:CONFIG(release, debug|release): LIBS += -L$$(LEAP_SDK)/lib/x86/ -lLeap
 else:win32:CONFIG(debug, debug|release): LIBS += -L$$(LEAP_SDK)/lib/x86/ -lLeapd
 else:unix: LIBS += -L$$(LEAP_SDK)/lib/x64/ -lLeap
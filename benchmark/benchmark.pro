@@ -0,0 +1,34 @@
+#-------------------------------------------------
+#
+# Microbenchmarks of the calibrationtools primitives,
+# run with an optional name filter:
+#   benchmark [filter]
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent
+QT       -= widgets
+
+TARGET = benchmark
+TEMPLATE = app
+CONFIG += console release
+CONFIG -= app_bundle
+
+SOURCES += main.cpp \
+    ../calibrationtools.cpp \
+    ../mpfit/mpfit.cpp
+
+HEADERS  += \
+    ../calibrationtools.h \
+    ../mpfit/mpfit.h \
+    ../lmsolver.h
+
+# qmake CONFIG+=openmp for the mpfit side=0 cases on several threads
+openmp {
+    msvc {
+        QMAKE_CXXFLAGS += -openmp
+    } else {
+        QMAKE_CXXFLAGS += -fopenmp
+        QMAKE_LFLAGS += -fopenmp
+    }
+}
@@ -0,0 +1,425 @@
+// Microbenchmarks of the calibrationtools primitives, in the manner of Google Benchmark: every case runs until
+// it has taken enough time and reports the time, heap allocations and, where the perf counters are available,
+// the instructions per operation. An optional argument selects the cases whose name contains it.
+
+#include "../calibrationtools.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QString>
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(Q_OS_LINUX) && defined(__GLIBC__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define HAVE_PERF_COUNTERS
+#define HAVE_MALLOC_COUNTER
+#endif
+
+// minimum time of the measured run of every case in ns
+static const qint64 MIN_TIME = 200000000;
+
+// the results are accumulated here, so the compiler cannot drop the measured work
+static volatile double sink;
+
+#ifdef HAVE_MALLOC_COUNTER
+// glibc's allocator under our malloc, which counts the calls. Qt containers allocate with malloc and operator new
+// ends up there as well.
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t count, size_t size);
+extern "C" void * __libc_realloc(void * pointer, size_t size);
+
+static QAtomicInt allocations;
+
+extern "C" void * malloc(size_t size)
+{
+    allocations.ref();
+    return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t count, size_t size)
+{
+    allocations.ref();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void * realloc(void * pointer, size_t size)
+{
+    allocations.ref();
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+// Retired user-space instructions of the calling thread, invalid if the kernel does not allow perf events
+class InstructionCounter
+{
+public:
+    InstructionCounter()
+        :fd(-1)
+    {
+#ifdef HAVE_PERF_COUNTERS
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~InstructionCounter()
+    {
+#ifdef HAVE_PERF_COUNTERS
+        if(fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool isValid() const
+    {
+        return fd >= 0;
+    }
+
+    void start()
+    {
+#ifdef HAVE_PERF_COUNTERS
+        if(fd < 0)
+            return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    long long stop()
+    {
+        long long count = 0;
+#ifdef HAVE_PERF_COUNTERS
+        if(fd < 0)
+            return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+#endif
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+// Calibration data of n point/marker pairs, the markers on a grid and the points mapped back by a known
+// transformation with 1 mm of deterministic noise, and n rays of three taps towards a projector
+struct Fixture
+{
+    explicit Fixture(int n)
+        :n(n), state(1)
+    {
+        M = createTransformationMatrix(0.3f, -0.2f, 0.1f, QVector3D(20.0f, 250.0f, -40.0f), QVector3D(2.5f, 2.6f, 1.0f));
+        QMatrix4x4 Mi = M.inverted();
+        QVector4D projector(100.0f, 1500.0f, 300.0f, 1.0f);
+
+        int w = 1;
+        while(w * w < n)
+            w++;
+        for(int i = 0; i < n; i++){
+            QVector4D marker(200.0f + 1500.0f * (i % w) / w, 100.0f + 900.0f * (i / w) / w, 0.0f, 1.0f);
+            QVector4D point = Mi * marker;
+            markers << marker;
+            points << point + QVector4D(noise(), noise(), noise(), 0.0f);
+
+            QVector<QVector4D> taps;
+            QVector3D direction = (projector - point).toVector3D().normalized();
+            for(int j = 0; j < 3; j++)
+                taps << point + QVector4D(direction * 50.0f * j + QVector3D(noise(), noise(), noise()), 0.0f);
+            rays << Ray::fit(taps);
+            rayPoints.append(taps);
+        }
+
+        getInitialParameters(points, markers, x);
+    }
+
+    double noise()
+    {
+        state = state * 1664525u + 1013904223u;
+        return state / 2147483648.0 - 1.0;
+    }
+
+    int n;
+    quint32 state;
+    QMatrix4x4 M;
+    QVector<QVector4D> points, markers;
+    QVector<Ray> rays;
+    QVector<QVector<QVector4D> > rayPoints;
+    double x[8];
+};
+
+typedef void (*BenchmarkFunction)(Fixture & fixture, qint64 iterations);
+
+static void closestPoint(Fixture & f, qint64 iterations)
+{
+    QVector4D point;
+    for(qint64 i = 0; i < iterations; i++){
+        f.rays[i % f.n].closestPoint(f.rays[(i + 1) % f.n], point);
+        sink = point.x();
+    }
+}
+
+static void intersect(Fixture & f, qint64 iterations)
+{
+    Plane plane(QVector3D(0.0f, 0.0f, 0.0f), QVector3D(0.0f, 1.0f, 0.0f));
+    QVector4D point;
+    for(qint64 i = 0; i < iterations; i++){
+        plane.intersect(f.rays[i % f.n], point);
+        sink = point.x();
+    }
+}
+
+static void transformationMatrix(Fixture & f, qint64 iterations)
+{
+    for(qint64 i = 0; i < iterations; i++){
+        QMatrix4x4 M = createTransformationMatrix(f.x[0] + i * 1e-9, f.x[1], f.x[2], QVector3D(f.x[3], f.x[4], f.x[5]), QVector3D(f.x[6], f.x[7], 1.0f));
+        sink = M(0, 0);
+    }
+}
+
+static void rayFit(Fixture & f, qint64 iterations)
+{
+    // n taps along one ray
+    QVector<QVector4D> taps;
+    for(int i = 0; i < f.n; i++)
+        taps << f.rayPoints[0][0] + (f.rayPoints[0][2] - f.rayPoints[0][0]) * (float(i) / f.n) + QVector4D(f.noise(), f.noise(), f.noise(), 0.0f);
+
+    for(qint64 i = 0; i < iterations; i++)
+        sink = Ray::fit(taps).direction.x();
+}
+
+static void projectorPosition(Fixture & f, qint64 iterations)
+{
+    QVector4D position;
+    for(qint64 i = 0; i < iterations; i++){
+        computeProjectorPosition(f.rays, position);
+        sink = position.x();
+    }
+}
+
+static void residuals(Fixture & f, qint64 iterations, bool derivatives)
+{
+    ErrorFuncPointData data(f.points, f.markers);
+    int m = 3 * f.n;
+    QVector<double> deviates(m), jacobian(m * 8);
+    double * derivs[8];
+    for(int k = 0; k < 8; k++)
+        derivs[k] = jacobian.data() + k * m;
+
+    double p[8];
+    memcpy(p, f.x, sizeof(p));
+    for(qint64 i = 0; i < iterations; i++){
+        errorFunc(m, 8, p, deviates.data(), derivatives ? derivs : NULL, &data);
+        sink = deviates[0];
+    }
+}
+
+static void errorFuncValues(Fixture & f, qint64 iterations)
+{
+    residuals(f, iterations, false);
+}
+
+static void errorFuncDerivatives(Fixture & f, qint64 iterations)
+{
+    residuals(f, iterations, true);
+}
+
+static void mpfitIteration(Fixture & f, qint64 iterations)
+{
+    ErrorFuncPointData data(f.points, f.markers);
+
+    mp_config config;
+    memset(&config, 0, sizeof(config));
+    config.maxiter = 1;
+
+    mp_par pars[8];
+    memset(pars, 0, sizeof(pars));
+    for(int k = 0; k < 8; k++)
+        pars[k].side = 3;
+
+    mp_workspace workspace;
+    mp_workspace_init(&workspace);
+
+    double p[8];
+    mp_result result;
+    for(qint64 i = 0; i < iterations; i++){
+        memcpy(p, f.x, sizeof(p));
+        memset(&result, 0, sizeof(result));
+        mpfit_ws(errorFunc, 3 * f.n, 8, p, pars, &config, &data, &result, &workspace);
+        sink = p[0];
+    }
+
+    mp_workspace_free(&workspace);
+}
+
+// One mpfit iteration with a finite-difference Jacobian (side = 0), its columns computed on the given number of threads
+static void mpfitFiniteDifference(Fixture & f, qint64 iterations, int threads)
+{
+    ErrorFuncPointData data(f.points, f.markers);
+
+    mp_config config;
+    memset(&config, 0, sizeof(config));
+    config.maxiter = 1;
+    config.nthreads = threads;
+
+    mp_par pars[8];
+    memset(pars, 0, sizeof(pars));
+
+    mp_workspace workspace;
+    mp_workspace_init(&workspace);
+
+    double p[8];
+    mp_result result;
+    for(qint64 i = 0; i < iterations; i++){
+        memcpy(p, f.x, sizeof(p));
+        memset(&result, 0, sizeof(result));
+        mpfit_ws(errorFunc, 3 * f.n, 8, p, pars, &config, &data, &result, &workspace);
+        sink = p[0];
+    }
+
+    mp_workspace_free(&workspace);
+}
+
+static void mpfitFiniteDifference1(Fixture & f, qint64 iterations)
+{
+    mpfitFiniteDifference(f, iterations, 1);
+}
+
+static void mpfitFiniteDifference2(Fixture & f, qint64 iterations)
+{
+    mpfitFiniteDifference(f, iterations, 2);
+}
+
+static void mpfitFiniteDifference4(Fixture & f, qint64 iterations)
+{
+    mpfitFiniteDifference(f, iterations, 4);
+}
+
+static void refineParameters(Fixture & f, qint64 iterations)
+{
+    double p[8];
+    for(qint64 i = 0; i < iterations; i++){
+        memcpy(p, f.x, sizeof(p));
+        sink = refineTransformationParameters(f.points, f.markers, p);
+    }
+}
+
+static void fromPoints(Fixture & f, qint64 iterations)
+{
+    for(qint64 i = 0; i < iterations; i++)
+        sink = computeTransformationMatrixFromPoints(f.points, f.markers)(0, 0);
+}
+
+static void fromPointsMpfit(Fixture & f, qint64 iterations)
+{
+    mp_workspace workspace;
+    mp_workspace_init(&workspace);
+    for(qint64 i = 0; i < iterations; i++)
+        sink = computeTransformationMatrixFromPoints(f.points, f.markers, MPFIT, &workspace)(0, 0);
+    mp_workspace_free(&workspace);
+}
+
+static void fromPointsRotationVector(Fixture & f, qint64 iterations)
+{
+    for(qint64 i = 0; i < iterations; i++)
+        sink = computeTransformationMatrixFromPoints(f.points, f.markers, LEVMAR_ROTATION_VECTOR)(0, 0);
+}
+
+struct Benchmark
+{
+    const char * name;
+    BenchmarkFunction function;
+    int sizes[6];           // point or ray counts, 0 terminated, a single size is left out of the name
+};
+
+static const Benchmark benchmarks[] = {
+    {"Ray::closestPoint", closestPoint, {4, 0}},
+    {"Plane::intersect", intersect, {4, 0}},
+    {"createTransformationMatrix", transformationMatrix, {4, 0}},
+    {"Ray::fit", rayFit, {3, 15, 100, 0}},
+    {"computeProjectorPosition", projectorPosition, {4, 9, 16, 25, 0}},
+    {"errorFunc", errorFuncValues, {4, 9, 16, 25, 64, 0}},
+    {"errorFunc+derivs", errorFuncDerivatives, {4, 9, 16, 25, 64, 0}},
+    {"mpfit iteration", mpfitIteration, {4, 9, 16, 25, 64, 0}},
+    {"mpfit iteration side=0 threads=1", mpfitFiniteDifference1, {25, 1024, 16384, 0}},
+    {"mpfit iteration side=0 threads=2", mpfitFiniteDifference2, {25, 1024, 16384, 0}},
+    {"mpfit iteration side=0 threads=4", mpfitFiniteDifference4, {25, 1024, 16384, 0}},
+    {"refineTransformationParameters", refineParameters, {4, 9, 16, 25, 64, 0}},
+    {"computeTransformationMatrixFromPoints", fromPoints, {4, 9, 16, 25, 64, 0}},
+    {"computeTransformationMatrixFromPoints MPFIT", fromPointsMpfit, {4, 9, 16, 25, 64, 0}},
+    {"computeTransformationMatrixFromPoints LEVMAR_ROTATION_VECTOR", fromPointsRotationVector, {4, 9, 16, 25, 64, 0}}
+};
+
+// the solvers print their results, which would swamp the table
+static void discardMessages(QtMsgType, const QMessageLogContext &, const QString &)
+{
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    qInstallMessageHandler(discardMessages);
+
+    QString filter = argc > 1 ? QString(argv[1]) : QString();
+    InstructionCounter counter;
+
+    printf("%-64s %14s %12s %12s %16s\n", "Benchmark", "Time", "Iterations", "Allocs/op", "Instructions/op");
+
+    for(size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++){
+        const Benchmark & benchmark = benchmarks[b];
+        for(int s = 0; benchmark.sizes[s]; s++){
+            QString name = benchmark.sizes[1] ? QString("%1/%2").arg(benchmark.name).arg(benchmark.sizes[s]) : QString(benchmark.name);
+            if(!name.contains(filter))
+                continue;
+
+            Fixture fixture(benchmark.sizes[s]);
+
+            // grow the iteration count until a run takes 10 ms, then size the measured run to MIN_TIME
+            QElapsedTimer timer;
+            qint64 iterations = 1, elapsed = 0;
+            while(true){
+                timer.start();
+                benchmark.function(fixture, iterations);
+                elapsed = timer.nsecsElapsed();
+                if(elapsed > MIN_TIME / 20 || iterations >= (qint64(1) << 40))
+                    break;
+                iterations *= 10;
+            }
+            iterations = qMax(qint64(1), qint64(1.2 * iterations * MIN_TIME / qMax(elapsed, qint64(1))));
+
+#ifdef HAVE_MALLOC_COUNTER
+            int allocationsBefore = allocations.load();
+#endif
+            counter.start();
+            timer.start();
+            benchmark.function(fixture, iterations);
+            elapsed = timer.nsecsElapsed();
+            long long instructions = counter.stop();
+
+            QString allocs = "-", instructionsPerOp = "-";
+#ifdef HAVE_MALLOC_COUNTER
+            allocs = QString::number(double(allocations.load() - allocationsBefore) / iterations, 'f', 1);
+#endif
+            if(counter.isValid())
+                instructionsPerOp = QString::number(double(instructions) / iterations, 'f', 0);
+
+            printf("%-64s %11.1f ns %12lld %12s %16s\n", qPrintable(name), double(elapsed) / iterations, (long long) iterations,
+                   qPrintable(allocs), qPrintable(instructionsPerOp));
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
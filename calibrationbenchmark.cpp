@@ -0,0 +1,450 @@
+#include "calibrationbenchmark.h"
+#include "calibrationserver.h"
+#include "calibrationpattern.h"
+#include "collector.h"
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <iostream>
+#include <algorithm>
+
+// a calibration, the connection and every response have to arrive within this many ms
+static const int LATENCY_TIMEOUT = 10000;
+
+// distance between the taps on a 3D marker, the first one touches the screen
+static const double HOVER_STEP = 50.0;
+// taps per marker of a 3D calibration, as in ScreenCalibration
+static const int TAPS_3D = 3;
+// the pixel errors are measured on a grid of this many points per side spanning the whole screen
+static const int EVALUATION_GRID = 7;
+// a configuration regresses when its mean pixel error or evaluations exceed the baseline by this fraction plus the
+// slack, which keeps the comparison quiet for errors that are already a fraction of a pixel
+static const double BASELINE_TOLERANCE = 0.1;
+static const double BASELINE_SLACK_PX = 0.05;
+
+SyntheticCalibration::SyntheticCalibration()
+    :type(NONE), M(), V(0.0f, 0.0f, 0.0f, 1.0f), points(), markers(), spreads()
+{
+}
+
+QVector4D SyntheticCalibration::surfacePoint(const QVector4D & screenPosition) const
+{
+    return M.inverted() * QVector4D(screenPosition.x(), screenPosition.y(), 0.0f, 1.0f);
+}
+
+QVector4D SyntheticCalibration::hoverPoint(const QVector4D & screenPosition, double hover) const
+{
+    QVector4D s = surfacePoint(screenPosition);
+    QVector3D direction = (V - s).toVector3D().normalized();
+    return s + QVector4D(direction * hover, 0.0f);
+}
+
+CalibrationGenerator::CalibrationGenerator(quint32 seed)
+    :state(seed ? seed : 1)
+{
+}
+
+// xorshift, a small generator of our own so the calibrations are the same on every platform
+double CalibrationGenerator::uniform(double a, double b)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return a + (b - a) * (state / 4294967296.0);
+}
+
+double CalibrationGenerator::normal()
+{
+    double u = qMax(uniform(0.0, 1.0), 1e-12);
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * uniform(0.0, 1.0));
+}
+
+QVector4D CalibrationGenerator::tap(const QVector4D & position, double noise, double & spread)
+{
+    QVector<QVector3D> samples;
+    for(int k = 0; k < MAX_POSITIONS; k++)
+        samples << position.toVector3D() + noise * QVector3D(normal(), normal(), normal());
+
+    return PointCollector::fingerPoint(samples, spread);
+}
+
+SyntheticCalibration CalibrationGenerator::generate(CalibrationType type, int gridSize, double noise, QSize screenSize)
+{
+    SyntheticCalibration c;
+    c.type = type;
+
+    // any orientation, the screen origin within the reach of the Leap and 1.5 to 4 px per mm
+    double scale = uniform(1.5, 4.0);
+    QVector3D translation(uniform(-300.0, 300.0), uniform(100.0, 500.0), uniform(-300.0, 300.0));
+    c.M = createTransformationMatrix(uniform(-M_PI, M_PI), uniform(-M_PI / 2, M_PI / 2), uniform(-M_PI, M_PI), translation,
+                                     QVector3D(scale, scale * uniform(0.9, 1.1), 1.0f));
+
+    // the projector 1 to 2.5 m in front of the screen centre, on the side of the Leap
+    QMatrix4x4 Mi = c.M.inverted();
+    QVector4D centre = Mi * QVector4D(screenSize.width() / 2, screenSize.height() / 2, 0.0f, 1.0f);
+    QVector3D normal = Mi.mapVector(QVector3D(0.0f, 0.0f, 1.0f)).normalized();
+    float side = (c.M * QVector4D(0.0f, 0.0f, 0.0f, 1.0f)).z() > 0.0f ? 1.0f : -1.0f;
+    QVector3D offset(uniform(-200.0, 200.0), uniform(-200.0, 200.0), uniform(-200.0, 200.0));
+    c.V = centre + QVector4D(side * uniform(1000.0, 2500.0) * normal + offset, 0.0f);
+
+    CalibrationPattern pattern;
+    pattern.distributeMarkers(screenSize, gridSize * gridSize, screenSize.width() / 32);
+    c.markers = pattern.getMarkerPositions();
+
+    int taps = type == C3D ? TAPS_3D : 1;
+    foreach(QVector4D marker, c.markers){
+        for(int j = 0; j < taps; j++){
+            double spread;
+            c.points << tap(c.hoverPoint(marker, j * HOVER_STEP), noise, spread);
+            c.spreads << spread;
+        }
+    }
+
+    return c;
+}
+
+static double mean(const QVector<double> & values)
+{
+    double sum = 0.0;
+    foreach(double value, values)
+        sum += value;
+    return values.isEmpty() ? 0.0 : sum / values.size();
+}
+
+static double maximum(const QVector<double> & values)
+{
+    double m = 0.0;
+    foreach(double value, values)
+        m = qMax(m, value);
+    return m;
+}
+
+static double median(QVector<double> values)
+{
+    if(values.isEmpty())
+        return 0.0;
+    qSort(values);
+    return values[values.size() / 2];
+}
+
+// RMS distance of the positions the calibration answers touch (or, with hover > 0, paint) requests at the true
+// query points with from the screen positions of those points, -1 if a query misses the screen
+static double queryError(const SyntheticCalibration & c, const CalibrationData & data, QSize screenSize, double hover)
+{
+    double error2 = 0.0;
+    for(int j = 0; j < EVALUATION_GRID; j++){
+        for(int i = 0; i < EVALUATION_GRID; i++){
+            QVector4D q((i + 0.5f) * screenSize.width() / EVALUATION_GRID, (j + 0.5f) * screenSize.height() / EVALUATION_GRID, 0.0f, 1.0f);
+
+            QVector4D position;
+            bool hit = hover > 0.0 ? CalibrationServer::paintPosition(data, c.hoverPoint(q, hover), position)
+                                   : CalibrationServer::touchPosition(data, c.surfacePoint(q), position);
+            if(!hit)
+                return -1.0;
+
+            error2 += (position.toVector2D() - q.toVector2D()).lengthSquared();
+        }
+    }
+    return sqrt(error2 / (EVALUATION_GRID * EVALUATION_GRID));
+}
+
+// true if value is worse than the baseline value by more than the tolerance
+static bool regressed(double value, double baseline, double slack)
+{
+    return value > baseline * (1.0 + BASELINE_TOLERANCE) + slack;
+}
+
+int runCalibrationBenchmark(CalibrationServer & server, int trials, const QString & baseline, const QString & output, quint32 seed)
+{
+    static const int gridSizes[] = {2, 3, 4};
+    static const double noises[] = {0.5, 2.0, 5.0};
+    QSize screenSize(1920, 1080);
+
+    std::cout << "type grid noise | touch px mean/max | paint px mean/max | normal deg | origin mm | projector mm | evaluations | ms median/mean | failed" << std::endl;
+
+    QJsonObject baselineResults;
+    if(!baseline.isEmpty()){
+        QFile baselineFile(baseline);
+        if(!baselineFile.open(QIODevice::ReadOnly)){
+            std::cerr << "ERROR: Cannot read the benchmark baseline " << qPrintable(baseline) << std::endl;
+            return 1;
+        }
+        baselineResults = QJsonDocument::fromJson(baselineFile.readAll()).object();
+    }
+
+    CalibrationGenerator generator(seed);
+    QJsonObject results;
+    int failures = 0, regressions = 0;
+
+    for(int t = 0; t < 2; t++){
+        CalibrationType type = t == 0 ? C2D : C3D;
+
+        for(int g = 0; g < 3; g++){
+            for(int n = 0; n < 3; n++){
+                QVector<double> touchErrors, paintErrors, normalErrors, originErrors, projectorErrors, times;
+                double evaluations = 0.0;
+                int failed = 0;
+
+                for(int trial = 0; trial < trials; trial++){
+                    SyntheticCalibration c = generator.generate(type, gridSizes[g], noises[n], screenSize);
+
+                    QElapsedTimer timer;
+                    timer.start();
+                    CalibrationJob job = server.solveCalibration(c.type, c.points, c.markers, c.spreads);
+                    double time = timer.nsecsElapsed() / 1e6;
+
+                    double touchError = job.valid ? queryError(c, job.data, screenSize, 0.0) : -1.0;
+                    double paintError = job.valid && type == C3D ? queryError(c, job.data, screenSize, 2 * HOVER_STEP) : 0.0;
+                    if(touchError < 0.0 || paintError < 0.0){
+                        failed++;
+                        continue;
+                    }
+
+                    touchErrors << touchError;
+                    if(type == C3D)
+                        paintErrors << paintError;
+
+                    // the screen normal, the screen origin in Leap coordinates and the projector against the true ones
+                    QVector3D trueNormal = c.M.row(2).toVector3D().normalized();
+                    QVector3D normal = job.data.M.row(2).toVector3D().normalized();
+                    // M may map the screen normal either way, only the orientation of the plane is compared
+                    normalErrors << acos(qBound(0.0, fabs(double(QVector3D::dotProduct(trueNormal, normal))), 1.0)) * 180.0 / M_PI;
+
+                    QVector3D trueOrigin = c.surfacePoint(QVector4D(0.0f, 0.0f, 0.0f, 1.0f)).toVector3D();
+                    QVector3D origin = (job.data.M.inverted() * QVector4D(0.0f, 0.0f, 0.0f, 1.0f)).toVector3DAffine();
+                    originErrors << (origin - trueOrigin).length();
+
+                    if(type == C3D)
+                        projectorErrors << (job.data.V - c.V).toVector3D().length();
+
+                    foreach(SolveStage stage, job.telemetry)
+                        evaluations += stage.nfev;
+                    times << time;
+                }
+
+                int solved = trials - failed;
+                failures += failed;
+
+                QString name = QString("%1 %2x%2 %3").arg(type == C2D ? "2D" : "3D").arg(gridSizes[g]).arg(noises[n], 0, 'f', 1);
+                QJsonObject result;
+                result["touch"] = mean(touchErrors);
+                result["paint"] = mean(paintErrors);
+                result["evaluations"] = solved > 0 ? evaluations / solved : 0.0;
+                result["failed"] = failed;
+                results[name] = result;
+
+                // times depend on the machine, so only the accuracy and the work done are compared
+                QString regression;
+                if(baselineResults.contains(name)){
+                    QJsonObject reference = baselineResults[name].toObject();
+                    if(regressed(result["touch"].toDouble(), reference["touch"].toDouble(), BASELINE_SLACK_PX))
+                        regression += " touch";
+                    if(regressed(result["paint"].toDouble(), reference["paint"].toDouble(), BASELINE_SLACK_PX))
+                        regression += " paint";
+                    if(regressed(result["evaluations"].toDouble(), reference["evaluations"].toDouble(), 0.0))
+                        regression += " evaluations";
+                    if(failed > reference["failed"].toInt())
+                        regression += " failed";
+                }
+                if(!regression.isEmpty())
+                    regressions++;
+
+                QStringList columns;
+                columns << name
+                        << QString("%1/%2").arg(mean(touchErrors), 0, 'f', 2).arg(maximum(touchErrors), 0, 'f', 2)
+                        << (type == C3D ? QString("%1/%2").arg(mean(paintErrors), 0, 'f', 2).arg(maximum(paintErrors), 0, 'f', 2) : QString("-"))
+                        << QString::number(mean(normalErrors), 'f', 3)
+                        << QString::number(mean(originErrors), 'f', 2)
+                        << (type == C3D ? QString::number(mean(projectorErrors), 'f', 1) : QString("-"))
+                        << QString::number(solved > 0 ? evaluations / solved : 0.0, 'f', 1)
+                        << QString("%1/%2").arg(median(times), 0, 'f', 2).arg(mean(times), 0, 'f', 2)
+                        << QString::number(failed);
+                if(!regression.isEmpty())
+                    columns.last() += " | REGRESSED:" + regression;
+                std::cout << qPrintable(columns.join(" | ")) << std::endl;
+            }
+        }
+    }
+
+    if(!output.isEmpty()){
+        QFile outputFile(output);
+        if(!outputFile.open(QIODevice::WriteOnly)){
+            std::cerr << "ERROR: Cannot write the benchmark results " << qPrintable(output) << std::endl;
+            return failures + regressions + 1;
+        }
+        outputFile.write(QJsonDocument(results).toJson());
+    }
+
+    if(!baseline.isEmpty())
+        std::cout << regressions << " configuration(s) regressed against " << qPrintable(baseline) << std::endl;
+
+    return failures + regressions;
+}
+
+LatencyClient::LatencyClient()
+    :QObject(), socket(), loop(), timer(), messages()
+{
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), &loop, SLOT(quit()));
+    connect(&socket, SIGNAL(connected()), this, SLOT(onConnected()));
+    connect(&socket, SIGNAL(textMessageReceived(QString)), this, SLOT(onTextMessage(QString)));
+}
+
+bool LatencyClient::open(const QUrl & url, int timeout)
+{
+    socket.open(url);
+    if(socket.state() != QAbstractSocket::ConnectedState){
+        timer.start(timeout);
+        loop.exec();
+        timer.stop();
+    }
+    if(socket.state() != QAbstractSocket::ConnectedState)
+        return false;
+
+    // QWebSocket has no socket options, disable Nagle's algorithm on its TCP socket so that only the server's
+    // setting is measured
+    QList<QAbstractSocket *> tcpSockets = socket.findChildren<QAbstractSocket *>();
+    if(tcpSockets.isEmpty())
+        std::cerr << "WARNING: Could not disable Nagle's algorithm on the client socket" << std::endl;
+    foreach(QAbstractSocket * tcpSocket, tcpSockets)
+        tcpSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    return true;
+}
+
+void LatencyClient::send(const QString & message)
+{
+    socket.sendTextMessage(message);
+}
+
+bool LatencyClient::next(QString & message, int timeout)
+{
+    if(messages.isEmpty()){
+        timer.start(timeout);
+        loop.exec();
+        timer.stop();
+    }
+    if(messages.isEmpty())
+        return false;
+
+    message = messages.takeFirst();
+    return true;
+}
+
+void LatencyClient::onConnected()
+{
+    loop.quit();
+}
+
+void LatencyClient::onTextMessage(const QString & message)
+{
+    messages << message;
+    loop.quit();
+}
+
+static double percentile(QVector<double> values, double p)
+{
+    if(values.isEmpty())
+        return 0.0;
+    qSort(values);
+    return values[qMin(values.size() - 1, int(p * values.size()))];
+}
+
+// Round trips in microseconds of requests touch requests to server over loopback, false if it could not be reached
+static bool measureLatency(CalibrationServer & server, int requests, quint32 seed, QVector<double> & latencies)
+{
+    if(!server.listenTuned(QHostAddress::LocalHost, 0)){
+        std::cerr << "ERROR: Server could not start listening" << std::endl;
+        return false;
+    }
+
+    LatencyClient client;
+    if(!client.open(QUrl(QString("ws://127.0.0.1:%1").arg(server.serverPort())), LATENCY_TIMEOUT)){
+        std::cerr << "ERROR: Client could not connect to the server" << std::endl;
+        return false;
+    }
+
+    // calibrate through the socket and wait for the calibration to be broadcast, skipping the progress messages
+    QSize screenSize(1920, 1080);
+    SyntheticCalibration c = CalibrationGenerator(seed).generate(C2D, 3, 0.5, screenSize);
+    client.send(createCalibRequest(c.type, c.points, c.markers, false, c.spreads));
+
+    QString message;
+    CalibrationData data;
+    do{
+        if(!client.next(message, LATENCY_TIMEOUT)){
+            std::cerr << "ERROR: No calibration response from the server" << std::endl;
+            return false;
+        }
+    }while(!parseCalibResponse(message, data) || data.T != C2D);
+
+    // a touch in the middle of the screen, answered without solving anything
+    QString request = createTouchRequest(c.surfacePoint(QVector4D(screenSize.width() / 2, screenSize.height() / 2, 0.0f, 1.0f)));
+    latencies.clear();
+    QElapsedTimer timer;
+    for(int i = 0; i < requests; i++){
+        timer.start();
+        client.send(request);
+
+        QVector4D position;
+        do{
+            if(!client.next(message, LATENCY_TIMEOUT)){
+                std::cerr << "ERROR: No touch response from the server" << std::endl;
+                return false;
+            }
+        }while(!parseTouchResponse(message, position));
+        latencies << timer.nsecsElapsed() / 1e3;
+    }
+
+    server.close();
+    return true;
+}
+
+int runLatencyBenchmark(int requests, int sendBufferSize, int receiveBufferSize, int cpu, quint32 seed)
+{
+    QVector<bool> tunedBuffers;
+    tunedBuffers << false;
+    if(sendBufferSize > 0 || receiveBufferSize > 0)
+        tunedBuffers << true;
+    // the pinned configurations run last, the pinning cannot be undone
+    QVector<int> pins;
+    pins << -1;
+    if(cpu >= 0)
+        pins << cpu;
+
+    std::cout << requests << " requests" << std::endl;
+    std::cout << "nodelay | sndbuf/rcvbuf | cpu | round trip us median/p90/p99/max" << std::endl;
+    foreach(int pin, pins){
+        foreach(bool tuned, tunedBuffers){
+            for(int noDelay = 0; noDelay < 2; noDelay++){
+                // a fresh server for every configuration, its options apply when it starts listening
+                CalibrationServer server((QString()));
+                server.setLowDelay(noDelay == 1);
+                server.setSendBufferSize(tuned ? sendBufferSize : 0);
+                server.setReceiveBufferSize(tuned ? receiveBufferSize : 0);
+                if(pin >= 0 && !server.setCpuAffinity(pin)){
+                    std::cerr << "ERROR: Could not pin server thread to CPU " << pin << std::endl;
+                    return 1;
+                }
+
+                QVector<double> latencies;
+                if(!measureLatency(server, requests, seed, latencies))
+                    return 1;
+
+                QString buffers = tuned ? QString("%1/%2").arg(sendBufferSize > 0 ? QString::number(sendBufferSize) : QString("default"))
+                                                          .arg(receiveBufferSize > 0 ? QString::number(receiveBufferSize) : QString("default"))
+                                        : QString("default");
+                std::cout << (noDelay == 1 ? "on" : "off") << " | " << qPrintable(buffers) << " | "
+                          << qPrintable(pin >= 0 ? QString::number(pin) : QString("-")) << " | "
+                          << qPrintable(QString("%1/%2/%3/%4").arg(percentile(latencies, 0.5), 0, 'f', 1)
+                                        .arg(percentile(latencies, 0.9), 0, 'f', 1)
+                                        .arg(percentile(latencies, 0.99), 0, 'f', 1)
+                                        .arg(percentile(latencies, 1.0), 0, 'f', 1)) << std::endl;
+            }
+        }
+    }
+    return 0;
+}
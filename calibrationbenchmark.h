@@ -0,0 +1,93 @@
+#ifndef CALIBRATIONBENCHMARK_H
+#define CALIBRATIONBENCHMARK_H
+
+#include <QVector>
+#include <QVector4D>
+#include <QSize>
+#include <QString>
+#include <QStringList>
+#include <QWebSocket>
+#include <QEventLoop>
+#include <QTimer>
+
+#include "calibrationdata.h"
+
+class CalibrationServer;
+
+// A calibration request with a known answer, the points are what PointCollector would record for the markers
+// of CalibrationPattern (or Pattern3D) on a screen with the true transformation and projector position
+struct SyntheticCalibration
+{
+    SyntheticCalibration();
+
+    // the query positions of the true calibration are the surface points, hover is the distance of the 3D paint
+    // position above the surface, towards the projector
+    QVector4D surfacePoint(const QVector4D & screenPosition) const;
+    QVector4D hoverPoint(const QVector4D & screenPosition, double hover) const;
+
+    CalibrationType type;
+    QMatrix4x4 M;                   // true transformation, see createTransformationMatrix
+    QVector4D V;                    // true projector position
+    QVector<QVector4D> points, markers;
+    QVector<double> spreads;
+};
+
+// Draws random screen poses, scales and projector positions and samples the taps with Gaussian Leap noise,
+// reproducible for a given seed
+class CalibrationGenerator
+{
+public:
+    explicit CalibrationGenerator(quint32 seed = 1);
+
+    // gridSize x gridSize markers on a screen of screenSize pixels, noise is the standard deviation of every
+    // finger position sample in mm
+    SyntheticCalibration generate(CalibrationType type, int gridSize, double noise, QSize screenSize = QSize(1920, 1080));
+
+private:
+    double uniform(double a, double b);
+    double normal();
+    QVector4D tap(const QVector4D & position, double noise, double & spread);
+
+    quint32 state;
+};
+
+// Solves trials synthetic calibrations of every configuration (2D and 3D, 2x2 to 4x4 markers, 0.5 to 5 mm noise)
+// with the pipeline and settings of server and prints the parameter and pixel errors, solver evaluations and solve
+// times per configuration. The results are saved to output and compared with a baseline saved by an earlier run,
+// either file name may be empty. Returns the number of failed solves plus the number of configurations whose pixel
+// errors, evaluations or failures regressed against the baseline.
+int runCalibrationBenchmark(CalibrationServer & server, int trials, const QString & baseline = QString(), const QString & output = QString(),
+                            quint32 seed = 1);
+
+// Connects to a server over loopback as ScreenCalibration does, installs a synthetic 2D calibration and sends
+// touch requests one after another, each when the previous one was answered. Every configuration gets its own
+// server: Nagle's algorithm on and off, default buffers and the given sizes (if any) and, last because the pinning
+// stays, the thread unpinned and pinned to cpu (if >= 0). Prints the median, 90th and 99th percentile and worst
+// round trip in microseconds of each configuration side by side. Returns 0 on success.
+int runLatencyBenchmark(int requests, int sendBufferSize = 0, int receiveBufferSize = 0, int cpu = -1, quint32 seed = 1);
+
+// The client side of the latency benchmark, waits for the messages of the server in a local event loop
+class LatencyClient: public QObject
+{
+    Q_OBJECT
+public:
+    LatencyClient();
+
+    bool open(const QUrl & url, int timeout);
+    void send(const QString & message);
+
+    // the next message from the server, false if none arrived within timeout ms
+    bool next(QString & message, int timeout);
+
+private slots:
+    void onConnected();
+    void onTextMessage(const QString & message);
+
+private:
+    QWebSocket socket;
+    QEventLoop loop;
+    QTimer timer;
+    QStringList messages;
+};
+
+#endif // CALIBRATIONBENCHMARK_H
@@ -1,7 +1,7 @@
 #include "calibrationdata.h"
 
 CalibrationData::CalibrationData()
-    : T(NONE), M(), V()
+    : T(NONE), M(), V(), P(), C()
 {
 }
 
@@ -36,12 +36,42 @@ bool CalibrationData::fromJson(const QJsonObject &o)
     if(projectorPositionValue.isUndefined() || !projectorPositionValue.isArray())
         return false;
 
+    // files written before the w component was dropped store four values
     QJsonArray projectorPositionArray = projectorPositionValue.toArray();
-    if(projectorPositionArray.size() != 3 || !projectorPositionArray[0].isDouble() || !projectorPositionArray[1].isDouble() || !projectorPositionArray[2].isDouble())
+    if(projectorPositionArray.size() < 3 || projectorPositionArray.size() > 4 || !projectorPositionArray[0].isDouble() || !projectorPositionArray[1].isDouble() || !projectorPositionArray[2].isDouble())
         return false;
 
     V = QVector4D(projectorPositionArray[0].toDouble(), projectorPositionArray[1].toDouble(), projectorPositionArray[2].toDouble(), 1.0f);
 
+    // the parameters are optional, older files do not have them
+    P.clear();
+    QJsonArray parameterArray = o.value("P").toArray();
+    if(parameterArray.size() == 8){
+        for(int i = 0; i < 8; i++){
+            if(!parameterArray[i].isDouble()){
+                P.clear();
+                break;
+            }
+            P << parameterArray[i].toDouble();
+        }
+    }
+
+    // so is the correction grid
+    C = CorrectionGrid();
+    QJsonObject correctionObject = o.value("C").toObject();
+    QJsonArray areaArray = correctionObject.value("area").toArray();
+    QJsonArray offsetArray = correctionObject.value("offsets").toArray();
+    int size = correctionObject.value("size").toInt();
+    if(size >= 2 && areaArray.size() == 4 && offsetArray.size() == 2 * size * size){
+        C.size = size;
+        C.x0 = areaArray[0].toDouble(); C.y0 = areaArray[1].toDouble();
+        C.x1 = areaArray[2].toDouble(); C.y1 = areaArray[3].toDouble();
+        foreach(QJsonValue offset, offsetArray)
+            C.offsets << offset.toDouble();
+        if(C.x1 <= C.x0 || C.y1 <= C.y0)
+            C = CorrectionGrid();
+    }
+
     return true;
 }
 
@@ -57,13 +87,37 @@ QJsonObject CalibrationData::toJson() const
     json["M"] = m;
 
     QJsonArray v;
-    for(int i = 0; i < 4; i++){
+    for(int i = 0; i < 3; i++){
         v.append(V[i]);
 
     }
 
     json["V"] = v;
 
+    if(P.size() == 8){
+        QJsonArray p;
+        foreach(double parameter, P)
+            p.append(parameter);
+        json["P"] = p;
+    }
+
+    if(!C.isEmpty()){
+        QJsonObject correction;
+        correction["size"] = C.size;
+
+        QJsonArray area;
+        area.append(C.x0); area.append(C.y0);
+        area.append(C.x1); area.append(C.y1);
+        correction["area"] = area;
+
+        QJsonArray offsets;
+        foreach(float offset, C.offsets)
+            offsets.append(offset);
+        correction["offsets"] = offsets;
+
+        json["C"] = correction;
+    }
+
     return json;
 }
 
@@ -328,10 +382,12 @@ bool parsePaintResponse(const QString & response, QVector4D & intersectionPoint)
     return true;
 }
 
-QString createCalibRequest(const CalibrationType & type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers)
+QString createCalibRequest(const CalibrationType & type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers, bool warmStart, const QVector<double> & spreads)
 {
     QJsonObject calibrateObject, messageObject;
     calibrateObject["type"] = double(type);
+    if(warmStart)
+        calibrateObject["warm"] = true;
 
     QJsonArray fingertips;
     foreach(QVector4D point, points){
@@ -343,6 +399,13 @@ QString createCalibRequest(const CalibrationType & type, const QVector<QVector4D
     }
     calibrateObject["fingertips"] = fingertips;
 
+    if(!spreads.isEmpty()){
+        QJsonArray spreadArray;
+        foreach(double spread, spreads)
+            spreadArray.append(spread);
+        calibrateObject["spread"] = spreadArray;
+    }
+
     QJsonArray markerArray;
     foreach(QVector4D point, markers){
         QJsonArray marker;
@@ -358,7 +421,7 @@ QString createCalibRequest(const CalibrationType & type, const QVector<QVector4D
     return request.toJson();
 }
 
-bool parseCalibRequest(const QString & request, CalibrationType & type, QVector<QVector4D> & points, QVector<QVector4D> & markers)
+bool parseCalibRequest(const QString & request, CalibrationType & type, QVector<QVector4D> & points, QVector<QVector4D> & markers, bool & warmStart, QVector<double> & spreads)
 {
     QJsonDocument messageDocument = QJsonDocument::fromJson(request.toUtf8());
     if(!messageDocument.isObject())
@@ -379,6 +442,9 @@ bool parseCalibRequest(const QString & request, CalibrationType & type, QVector<
 
     type = CalibrationType(calibrationTypeValue.toInt());
 
+    // start from the stored solution instead of the closed-form estimate
+    warmStart = calibrateObject.value("warm").toBool(false);
+
     // get calibration points
     QJsonValue calibrationPointsValue = calibrateObject.value("fingertips");
     if(calibrationPointsValue.isUndefined() || !calibrationPointsValue.isArray())
@@ -425,15 +491,93 @@ bool parseCalibRequest(const QString & request, CalibrationType & type, QVector<
         markers << marker;
     }
 
+    // spreads are optional, a request without one for every fingertip is fitted unweighted
+    QJsonValue spreadValue = calibrateObject.value("spread");
+    if(spreadValue.isArray()){
+        QJsonArray spreadArray = spreadValue.toArray();
+        foreach(QJsonValue value, spreadArray){
+            if(!value.isDouble() || value.toDouble() < 0.0){
+                spreads.clear();
+                break;
+            }
+            spreads << value.toDouble();
+        }
+        if(spreads.size() != points.size())
+            spreads.clear();
+    }
+
     return true;
 }
 
-QString createCalibResponse(const CalibrationData & d)
+QJsonArray createTelemetryArray(const QVector<SolveStage> & telemetry)
+{
+    QJsonArray telemetryArray;
+    foreach(SolveStage stage, telemetry){
+        QJsonObject stageObject;
+        stageObject["stage"] = stage.name;
+        stageObject["time"] = stage.time;
+        stageObject["niter"] = stage.niter;
+        stageObject["nfev"] = stage.nfev;
+        stageObject["status"] = stage.status;
+        stageObject["orignorm"] = stage.orignorm;
+        stageObject["bestnorm"] = stage.bestnorm;
+        telemetryArray.append(stageObject);
+    }
+    return telemetryArray;
+}
+
+QString createCalibResponse(const CalibrationData & d, const QVector<int> & rejectedMarkers, const CalibrationUncertainty & uncertainty,
+                            const QMap<int, double> & heldOutErrors, const QVector<SolveStage> & telemetry)
 {
     QJsonObject messageObject;
 
     messageObject["calibrationData"] = d.toJson();
 
+    if(!rejectedMarkers.isEmpty()){
+        QJsonArray rejectedArray;
+        foreach(int marker, rejectedMarkers)
+            rejectedArray.append(marker);
+        messageObject["rejectedMarkers"] = rejectedArray;
+    }
+
+    if(!uncertainty.parameters.isEmpty()){
+        QJsonObject uncertaintyObject;
+        uncertaintyObject["bootstrap"] = uncertainty.bootstrapSamples;
+
+        QJsonArray parameterArray;
+        foreach(double parameter, uncertainty.parameters)
+            parameterArray.append(parameter);
+        uncertaintyObject["parameters"] = parameterArray;
+
+        QJsonArray errorMapArray;
+        foreach(QVector3D error, uncertainty.errorMap){
+            QJsonArray errorArray;
+            errorArray.append(error.x());
+            errorArray.append(error.y());
+            errorArray.append(error.z());
+            errorMapArray.append(errorArray);
+        }
+        uncertaintyObject["errorMap"] = errorMapArray;
+
+        messageObject["uncertainty"] = uncertaintyObject;
+    }
+
+    // pairs of marker index and held-out error
+    if(!heldOutErrors.isEmpty()){
+        QJsonArray crossValidationArray;
+        QMap<int, double>::const_iterator it;
+        for(it = heldOutErrors.constBegin(); it != heldOutErrors.constEnd(); ++it){
+            QJsonArray markerArray;
+            markerArray.append(it.key());
+            markerArray.append(it.value());
+            crossValidationArray.append(markerArray);
+        }
+        messageObject["crossValidation"] = crossValidationArray;
+    }
+
+    if(!telemetry.isEmpty())
+        messageObject["telemetry"] = createTelemetryArray(telemetry);
+
     QJsonDocument response(messageObject);
     return response.toJson();
 }
@@ -454,3 +598,349 @@ bool parseCalibResponse(const QString & response, CalibrationData & d)
 
     return d.fromJson(dataObject);
 }
+
+bool parseRejectedMarkers(const QString & response, QVector<int> & rejectedMarkers)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("rejectedMarkers");
+    if(messageValue.isUndefined() || !messageValue.isArray())
+        return false;
+
+    QJsonArray rejectedArray = messageValue.toArray();
+    rejectedMarkers.clear();
+    for(int i = 0; i < rejectedArray.size(); i++){
+        if(!rejectedArray[i].isDouble())
+            return false;
+        rejectedMarkers << rejectedArray[i].toInt();
+    }
+
+    return true;
+}
+
+QString createStreamRequest(const CalibrationType & type, int index, int marker, const QVector4D & point, const QVector4D & markerPosition)
+{
+    QJsonObject streamObject, messageObject;
+    streamObject["type"] = double(type);
+    streamObject["index"] = index;
+    streamObject["marker"] = marker;
+
+    QJsonArray fingertip;
+    fingertip.append(point.x());
+    fingertip.append(point.y());
+    fingertip.append(point.z());
+    streamObject["fingertip"] = fingertip;
+
+    QJsonArray position;
+    position.append(markerPosition.x());
+    position.append(markerPosition.y());
+    streamObject["position"] = position;
+
+    messageObject["stream"] = streamObject;
+
+    QJsonDocument request(messageObject);
+    return request.toJson();
+}
+
+bool parseStreamRequest(const QString & request, CalibrationType & type, int & index, int & marker, QVector4D & point, QVector4D & markerPosition)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(request.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("stream");
+    if(messageValue.isUndefined() || !messageValue.isObject())
+        return false;
+
+    QJsonObject streamObject = messageValue.toObject();
+
+    QJsonValue typeValue = streamObject.value("type");
+    QJsonValue indexValue = streamObject.value("index");
+    QJsonValue markerValue = streamObject.value("marker");
+    if(!typeValue.isDouble() || !indexValue.isDouble() || !markerValue.isDouble())
+        return false;
+
+    type = CalibrationType(typeValue.toInt());
+    index = indexValue.toInt();
+    marker = markerValue.toInt();
+
+    QJsonValue fingertipValue = streamObject.value("fingertip");
+    if(fingertipValue.isUndefined() || !fingertipValue.isArray())
+        return false;
+
+    QJsonArray fingertipArray = fingertipValue.toArray();
+    if(fingertipArray.size() != 3 || !fingertipArray[0].isDouble() || !fingertipArray[1].isDouble() || !fingertipArray[2].isDouble())
+        return false;
+
+    point = QVector4D(fingertipArray[0].toDouble(), fingertipArray[1].toDouble(), fingertipArray[2].toDouble(), 1.0);
+
+    QJsonValue positionValue = streamObject.value("position");
+    if(positionValue.isUndefined() || !positionValue.isArray())
+        return false;
+
+    QJsonArray positionArray = positionValue.toArray();
+    if(positionArray.size() != 2 || !positionArray[0].isDouble() || !positionArray[1].isDouble())
+        return false;
+
+    markerPosition = QVector4D(positionArray[0].toDouble(), positionArray[1].toDouble(), 0.0, 1.0);
+
+    return true;
+}
+
+QString createProvisionalResponse(int markers, double error, bool heldOut)
+{
+    QJsonObject provisionalObject, messageObject;
+    provisionalObject["markers"] = markers;
+    provisionalObject["error"] = error;
+    provisionalObject["heldOut"] = heldOut;
+
+    messageObject["provisional"] = provisionalObject;
+
+    QJsonDocument response(messageObject);
+    return response.toJson();
+}
+
+bool parseProvisionalResponse(const QString & response, int & markers, double & error, bool & heldOut)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("provisional");
+    if(messageValue.isUndefined() || !messageValue.isObject())
+        return false;
+
+    QJsonObject provisionalObject = messageValue.toObject();
+
+    QJsonValue markersValue = provisionalObject.value("markers");
+    QJsonValue errorValue = provisionalObject.value("error");
+    if(!markersValue.isDouble() || !errorValue.isDouble())
+        return false;
+
+    markers = markersValue.toInt();
+    error = errorValue.toDouble();
+    heldOut = provisionalObject.value("heldOut").toBool();
+
+    return true;
+}
+
+QString createCancelRequest()
+{
+    QJsonObject messageObject;
+    messageObject["cancel"] = true;
+
+    QJsonDocument request(messageObject);
+    return request.toJson();
+}
+
+bool parseCancelRequest(const QString & request)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(request.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("cancel");
+    return messageValue.isBool() && messageValue.toBool();
+}
+
+QString createProgressResponse(int iteration, double chi2)
+{
+    QJsonObject progressObject, messageObject;
+    progressObject["iteration"] = iteration;
+    progressObject["chi2"] = chi2;
+
+    messageObject["progress"] = progressObject;
+
+    QJsonDocument response(messageObject);
+    return response.toJson();
+}
+
+bool parseProgressResponse(const QString & response, int & iteration, double & chi2)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("progress");
+    if(messageValue.isUndefined() || !messageValue.isObject())
+        return false;
+
+    QJsonObject progressObject = messageValue.toObject();
+
+    QJsonValue iterationValue = progressObject.value("iteration");
+    QJsonValue chi2Value = progressObject.value("chi2");
+    if(!iterationValue.isDouble() || !chi2Value.isDouble())
+        return false;
+
+    iteration = iterationValue.toInt();
+    chi2 = chi2Value.toDouble();
+
+    return true;
+}
+
+bool parseCalibUncertainty(const QString & response, CalibrationUncertainty & uncertainty)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("uncertainty");
+    if(messageValue.isUndefined() || !messageValue.isObject())
+        return false;
+
+    QJsonObject uncertaintyObject = messageValue.toObject();
+
+    QJsonValue bootstrapValue = uncertaintyObject.value("bootstrap");
+    QJsonValue parametersValue = uncertaintyObject.value("parameters");
+    QJsonValue errorMapValue = uncertaintyObject.value("errorMap");
+    if(!bootstrapValue.isDouble() || !parametersValue.isArray() || !errorMapValue.isArray())
+        return false;
+
+    uncertainty = CalibrationUncertainty();
+    uncertainty.bootstrapSamples = bootstrapValue.toInt();
+
+    foreach(QJsonValue parameterValue, parametersValue.toArray()){
+        if(!parameterValue.isDouble())
+            return false;
+        uncertainty.parameters << parameterValue.toDouble();
+    }
+
+    foreach(QJsonValue errorValue, errorMapValue.toArray()){
+        if(!errorValue.isArray())
+            return false;
+
+        QJsonArray errorArray = errorValue.toArray();
+        if(errorArray.size() != 3 || !errorArray[0].isDouble() || !errorArray[1].isDouble() || !errorArray[2].isDouble())
+            return false;
+
+        uncertainty.errorMap << QVector3D(errorArray[0].toDouble(), errorArray[1].toDouble(), errorArray[2].toDouble());
+    }
+
+    return true;
+}
+
+bool parseHeldOutErrors(const QString & response, QMap<int, double> & heldOutErrors)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("crossValidation");
+    if(messageValue.isUndefined() || !messageValue.isArray())
+        return false;
+
+    heldOutErrors.clear();
+    foreach(QJsonValue markerValue, messageValue.toArray()){
+        if(!markerValue.isArray())
+            return false;
+
+        QJsonArray markerArray = markerValue.toArray();
+        if(markerArray.size() != 2 || !markerArray[0].isDouble() || !markerArray[1].isDouble())
+            return false;
+
+        heldOutErrors[markerArray[0].toInt()] = markerArray[1].toDouble();
+    }
+
+    return true;
+}
+
+bool parseSolveTelemetry(const QString & response, QVector<SolveStage> & telemetry)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(response.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("telemetry");
+    if(messageValue.isUndefined() || !messageValue.isArray())
+        return false;
+
+    telemetry.clear();
+    foreach(QJsonValue stageValue, messageValue.toArray()){
+        if(!stageValue.isObject())
+            return false;
+
+        QJsonObject stageObject = stageValue.toObject();
+        if(!stageObject.value("stage").isString() || !stageObject.value("time").isDouble())
+            return false;
+
+        // counters missing for a closed-form stage are read as 0
+        SolveStage stage;
+        stage.name = stageObject.value("stage").toString();
+        stage.time = stageObject.value("time").toDouble();
+        stage.niter = stageObject.value("niter").toInt();
+        stage.nfev = stageObject.value("nfev").toInt();
+        stage.status = stageObject.value("status").toInt();
+        stage.orignorm = stageObject.value("orignorm").toDouble();
+        stage.bestnorm = stageObject.value("bestnorm").toDouble();
+        telemetry << stage;
+    }
+
+    return true;
+}
+
+QString createBatchRequest(bool batch)
+{
+    QJsonObject messageObject;
+    messageObject["batch"] = batch;
+
+    QJsonDocument request(messageObject);
+    return request.toJson();
+}
+
+bool parseBatchRequest(const QString & request, bool & batch)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(request.toUtf8());
+    if(!messageDocument.isObject())
+        return false;
+
+    QJsonObject messageObject = messageDocument.object();
+
+    QJsonValue messageValue = messageObject.value("batch");
+    if(messageValue.isUndefined() || !messageValue.isBool())
+        return false;
+
+    batch = messageValue.toBool();
+
+    return true;
+}
+
+QString createBatchMessage(const QStringList & messages)
+{
+    // messages are already serialized JSON objects, so the array is joined as text instead of being parsed again
+    return QString("[") + messages.join(",") + QString("]");
+}
+
+bool parseBatchMessage(const QString & message, QStringList & messages)
+{
+    QJsonDocument messageDocument = QJsonDocument::fromJson(message.toUtf8());
+    if(!messageDocument.isArray())
+        return false;
+
+    QJsonArray messageArray = messageDocument.array();
+    foreach(QJsonValue messageValue, messageArray){
+        if(!messageValue.isObject())
+            return false;
+
+        messages << QJsonDocument(messageValue.toObject()).toJson();
+    }
+
+    return true;
+}
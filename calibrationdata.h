@@ -6,6 +6,8 @@
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <QStringList>
+#include <QMap>
 
 #include "calibrationtools.h"
 
@@ -21,13 +23,37 @@ struct CalibrationData
     CalibrationType T;
     QMatrix4x4 M; 
     QVector4D V;
+    // parameters of M as fitted, {rotX, rotY, rotZ, tX, tY, tZ, scaleX, scaleY}, empty if not known
+    QVector<double> P;
+    // residual correction added to the screen positions given by M, empty if not fitted
+    CorrectionGrid C;
 };
 
-QString createCalibRequest(const CalibrationType &, const QVector<QVector4D> &, const QVector<QVector4D> &);
-bool parseCalibRequest(const QString &, CalibrationType &, QVector<QVector4D> &, QVector<QVector4D> &);
+// spreads optionally holds the standard error of every fingertip position, see PointCollector::getSpreads
+QString createCalibRequest(const CalibrationType &, const QVector<QVector4D> &, const QVector<QVector4D> &, bool warmStart = false, const QVector<double> & spreads = QVector<double>());
+bool parseCalibRequest(const QString &, CalibrationType &, QVector<QVector4D> &, QVector<QVector4D> &, bool &, QVector<double> &);
 
-QString createCalibResponse(const CalibrationData &);
+QString createCalibResponse(const CalibrationData &, const QVector<int> & rejectedMarkers = QVector<int>(), const CalibrationUncertainty & uncertainty = CalibrationUncertainty(),
+                            const QMap<int, double> & heldOutErrors = QMap<int, double>(), const QVector<SolveStage> & telemetry = QVector<SolveStage>());
 bool parseCalibResponse(const QString &, CalibrationData &);
+bool parseRejectedMarkers(const QString &, QVector<int> &);
+bool parseCalibUncertainty(const QString &, CalibrationUncertainty &);
+bool parseHeldOutErrors(const QString &, QMap<int, double> &);
+bool parseSolveTelemetry(const QString &, QVector<SolveStage> &);
+// the stages of a solve as in the calibration response, one object per stage
+QJsonArray createTelemetryArray(const QVector<SolveStage> &);
+
+QString createStreamRequest(const CalibrationType &, int, int, const QVector4D &, const QVector4D &);
+bool parseStreamRequest(const QString &, CalibrationType &, int &, int &, QVector4D &, QVector4D &);
+
+QString createProvisionalResponse(int, double, bool);
+bool parseProvisionalResponse(const QString &, int &, double &, bool &);
+
+QString createCancelRequest();
+bool parseCancelRequest(const QString &);
+
+QString createProgressResponse(int, double);
+bool parseProgressResponse(const QString &, int &, double &);
 
 QString createPointRequest(const QVector4D &, const QVector4D &);
 bool parsePointRequest(const QString &, QVector4D &, QVector4D &);
@@ -47,4 +73,10 @@ bool parsePaintRequest(const QString &, QVector4D &);
 QString createPaintResponse(const QVector4D &);
 bool parsePaintResponse(const QString &, QVector4D &);
 
+QString createBatchRequest(bool);
+bool parseBatchRequest(const QString &, bool &);
+
+QString createBatchMessage(const QStringList &);
+bool parseBatchMessage(const QString &, QStringList &);
+
 #endif // CALIBRATIONDATA_H
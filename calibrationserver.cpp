@@ -1,20 +1,198 @@
 #include "calibrationserver.h"
 #include "calibrationtools.h"
 
-CalibrationServer::CalibrationServer() :
-    QWebSocketServer(QString(""), QWebSocketServer::NonSecureMode), calibrationData(), clients()
+#include <QDebug>
+#include <QtConcurrent>
+
+#include <cstring>
+#include <cmath>
+
+#ifdef Q_OS_WIN
+#include <winsock2.h>
+#include <windows.h>
+typedef SOCKET NativeSocket;
+#define closeNativeSocket closesocket
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+typedef int NativeSocket;
+#define INVALID_SOCKET (-1)
+#define closeNativeSocket ::close
+#endif
+
+CalibrationJob::CalibrationJob() :
+    type(NONE), points(), markers(), spreads(), warmStart(false), stored(), valid(false), data(), rejected(), uncertainty(), heldOutErrors(), telemetry()
 {
-    this->read("s.dat");
+}
+
+CalibrationServer::CalibrationServer(const QString & dataFile) :
+    QWebSocketServer(QString(""), QWebSocketServer::NonSecureMode), dataFile(dataFile), lowDelay(false), sendBufferSize(0), receiveBufferSize(0), calibrationData(), clients(), batchingClients(), pendingMessages(), solver(LEVMAR), multiStartSeeds(0), multiStartBudget(0), inlierThreshold(0.0), bootstrapSamples(0),
+    solveDeadline(0), homographyModel(false), homographyStart(false), correctionGridSize(0), telemetryLog(), calibrationWatcher(NULL), solveControl(NULL), calibrationJobs(), progressTimer(),
+    streamType(NONE), streamPoints(), streamMarkers(), streamMarkerIndices(), streamSolved(false)
+{
+    if(!dataFile.isEmpty())
+        this->read(dataFile);
     connect(this, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
 }
 
 CalibrationServer::~CalibrationServer()
 {
+    // the workers read the settings of the server, so they have to be done before it goes
+    QHash<QFutureWatcher<CalibrationJob> *, SolverControl *>::const_iterator it;
+    for(it = calibrationJobs.constBegin(); it != calibrationJobs.constEnd(); ++it)
+        it.value()->cancel();
+    for(it = calibrationJobs.constBegin(); it != calibrationJobs.constEnd(); ++it){
+        it.key()->waitForFinished();
+        delete it.key();
+        delete it.value();
+    }
     this->close();
-    this->write("s.dat");
+    if(!dataFile.isEmpty())
+        this->write(dataFile);
     qDeleteAll(this->clients);
 }
 
+static bool setSocketOption(NativeSocket socket, int level, int option, int value)
+{
+    return ::setsockopt(socket, level, option, (const char *) &value, sizeof(value)) == 0;
+}
+
+void CalibrationServer::setLowDelay(bool enabled)
+{
+    // disable Nagle's algorithm, cursor responses are tiny and should not wait for more data
+    lowDelay = enabled;
+}
+
+void CalibrationServer::setSendBufferSize(int size)
+{
+    sendBufferSize = size;
+}
+
+void CalibrationServer::setReceiveBufferSize(int size)
+{
+    receiveBufferSize = size;
+}
+
+bool CalibrationServer::listenTuned(const QHostAddress & address, quint16 port)
+{
+    if(!lowDelay && sendBufferSize <= 0 && receiveBufferSize <= 0)
+        return QWebSocketServer::listen(address, port);
+
+    // QWebSocket does not expose the connected sockets, they inherit the options of the listening socket instead,
+    // which are only sure to apply to every connection (the receive buffer size decides the TCP window scale) when
+    // they are set before listen(), so the listening socket is created here and handed to the server
+    if(address.protocol() != QAbstractSocket::IPv4Protocol){
+        qDebug() << "WARNING: Socket options are only applied on IPv4 addresses";
+        return QWebSocketServer::listen(address, port);
+    }
+
+#ifdef Q_OS_WIN
+    WSADATA wsaData;
+    bool winsock = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+    if(!winsock)
+        return false;
+#endif
+
+    bool listening = false;
+    NativeSocket socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(socket != INVALID_SOCKET){
+#ifndef Q_OS_WIN
+        // as QTcpServer does, so a restarted server can bind while old connections linger
+        setSocketOption(socket, SOL_SOCKET, SO_REUSEADDR, 1);
+#endif
+        if(lowDelay && !setSocketOption(socket, IPPROTO_TCP, TCP_NODELAY, 1))
+            qDebug() << "WARNING: Could not disable Nagle's algorithm";
+        if(sendBufferSize > 0 && !setSocketOption(socket, SOL_SOCKET, SO_SNDBUF, sendBufferSize))
+            qDebug() << "WARNING: Could not set send buffer size to" << sendBufferSize;
+        if(receiveBufferSize > 0 && !setSocketOption(socket, SOL_SOCKET, SO_RCVBUF, receiveBufferSize))
+            qDebug() << "WARNING: Could not set receive buffer size to" << receiveBufferSize;
+
+        sockaddr_in socketAddress;
+        memset(&socketAddress, 0, sizeof(socketAddress));
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_port = htons(port);
+        socketAddress.sin_addr.s_addr = htonl(address.toIPv4Address());
+
+        listening = ::bind(socket, (sockaddr *) &socketAddress, sizeof(socketAddress)) == 0 && ::listen(socket, SOMAXCONN) == 0
+                && setSocketDescriptor(qintptr(socket));
+        if(!listening)
+            closeNativeSocket(socket);
+    }
+
+#ifdef Q_OS_WIN
+    // balances the WSAStartup above, the socket engine of the server holds its own reference once it owns the socket
+    if(winsock)
+        WSACleanup();
+#endif
+    return listening;
+}
+
+bool CalibrationServer::setCpuAffinity(int cpu)
+{
+    // the server lives in the calling thread, pin it to a single CPU
+#if defined(Q_OS_WIN)
+    if(cpu < 0 || cpu >= int(sizeof(DWORD_PTR) * 8))
+        return false;
+    return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(Q_OS_LINUX)
+    if(cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) == 0;
+#else
+    Q_UNUSED(cpu);
+    return false;
+#endif
+}
+
+void CalibrationServer::setSolver(SolverType type)
+{
+    solver = type;
+}
+
+void CalibrationServer::setMultiStart(int seeds, int timeBudget)
+{
+    multiStartSeeds = seeds;
+    multiStartBudget = timeBudget;
+}
+
+void CalibrationServer::setInlierThreshold(double threshold)
+{
+    inlierThreshold = threshold;
+}
+
+void CalibrationServer::setHomography(bool enabled, bool start)
+{
+    homographyModel = enabled;
+    homographyStart = start;
+}
+
+void CalibrationServer::setCorrectionGrid(int size)
+{
+    correctionGridSize = size;
+}
+
+void CalibrationServer::setBootstrap(int samples)
+{
+    bootstrapSamples = samples;
+}
+
+void CalibrationServer::setSolveDeadline(int deadline)
+{
+    solveDeadline = deadline;
+}
+
+void CalibrationServer::setTelemetryLog(const QString & filename)
+{
+    telemetryLog = filename;
+}
+
 void CalibrationServer::write(QString filename)
 {
     QJsonObject o = calibrationData.toJson();
@@ -27,6 +205,34 @@ void CalibrationServer::write(QString filename)
     outputFile.close();
 }
 
+void CalibrationServer::writeTelemetry(const CalibrationJob & job)
+{
+    static const qint64 TELEMETRY_LOG_SIZE = 1024 * 1024;
+
+    if(telemetryLog.isEmpty())
+        return;
+
+    if(QFileInfo(telemetryLog).size() > TELEMETRY_LOG_SIZE){
+        QFile::remove(telemetryLog + ".1");
+        QFile::rename(telemetryLog, telemetryLog + ".1");
+    }
+
+    QJsonObject o;
+    o["time"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    o["type"] = job.type == C2D ? QString("2D") : QString("3D");
+    o["points"] = job.points.size();
+    o["markers"] = job.markers.size();
+    o["stages"] = createTelemetryArray(job.telemetry);
+
+    QFile outputFile(telemetryLog);
+    if(!outputFile.open(QIODevice::WriteOnly | QIODevice::Append)){
+        qDebug() << "ERROR: Cannot write the telemetry log" << telemetryLog;
+        return;
+    }
+    outputFile.write(QJsonDocument(o).toJson(QJsonDocument::Compact) + "\n");
+    outputFile.close();
+}
+
 void CalibrationServer::read(QString filename)
 {
     QFile inputFile(filename);
@@ -39,26 +245,211 @@ void CalibrationServer::read(QString filename)
     calibrationData.fromJson(d.object());
 }
 
-void CalibrationServer::calibrate(CalibrationType type, QVector<QVector4D> points, QVector<QVector4D> markers)
+void CalibrationServer::calibrate(CalibrationType type, QVector<QVector4D> points, QVector<QVector4D> markers, QVector<double> spreads, bool warmStart)
 {   
     if(type != C2D && type != C3D)
         return;
 
+    // a new request supersedes the one being solved, which finishes in the background
+    cancelCalibration();
+
+    solveControl = new SolverControl(solveDeadline > 0 ? solveDeadline : -1, this);
+    connect(solveControl, SIGNAL(progress(int,double)), this, SLOT(onSolveProgress(int,double)));
+    progressTimer.start();
+
+    calibrationWatcher = new QFutureWatcher<CalibrationJob>(this);
+    connect(calibrationWatcher, SIGNAL(finished()), this, SLOT(onCalibrationFinished()));
+    calibrationJobs.insert(calibrationWatcher, solveControl);
+
+    CalibrationJob job;
+    job.type = type;
+    job.points = points;
+    job.markers = markers;
+    job.spreads = spreads;
+    job.warmStart = warmStart;
+    job.stored = calibrationData;
+
+    calibrationWatcher->setFuture(QtConcurrent::run(this, &CalibrationServer::runCalibration, job, solveControl));
+}
+
+CalibrationJob CalibrationServer::solveCalibration(CalibrationType type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers,
+                                                   const QVector<double> & spreads)
+{
+    CalibrationJob job;
+    job.type = type;
+    job.points = points;
+    job.markers = markers;
+    job.spreads = spreads;
+    job.stored = calibrationData;
+
+    SolverControl control(solveDeadline > 0 ? solveDeadline : -1);
+    return runCalibration(job, &control);
+}
+
+// Stops the calibration being solved without blocking, its result is discarded when its watcher reports it finished
+void CalibrationServer::cancelCalibration()
+{
+    if(!solveControl)
+        return;
+
+    solveControl->cancel();
+    disconnect(solveControl, SIGNAL(progress(int,double)), this, SLOT(onSolveProgress(int,double)));
+    calibrationWatcher = NULL;
+    solveControl = NULL;
+}
+
+// The screen plane is where the third row of M vanishes, which holds for the rigid transformation and the homography
+// alike and needs no inverse of M per query
+static Plane screenPlane(const QMatrix4x4 & M)
+{
+    QVector4D row = M.row(2);
+    QVector3D normal = row.toVector3D();
+    return Plane(-row.w() * normal / normal.lengthSquared(), normal);
+}
+
+// screen position of a point in the screen plane, a homography leaves w different from 1
+static QVector4D screenPosition(const QMatrix4x4 & M, const QVector4D & point)
+{
+    return QVector4D((M * point).toVector3DAffine(), 1.0f);
+}
+
+// the position reported to the clients, with the residual correction of the calibration
+static QVector4D correctedPosition(const CalibrationData & data, const QVector4D & point)
+{
+    QVector4D position = screenPosition(data.M, point);
+    if(data.C.isEmpty())
+        return position;
+
+    return QVector4D(data.C.correct(position.toVector2D()), position.z(), 1.0f);
+}
+
+// Correction grid for the residuals of the positions the query path computes for the calibration points, touch positions
+// for a 2D calibration and paint positions, projected from the projector, for a 3D one
+static CorrectionGrid fitCorrection(const CalibrationData & data, const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int size)
+{
+    if(size < 2)
+        return CorrectionGrid();
+
+    Plane plane = screenPlane(data.M);
+    QVector<QVector2D> positions, residuals;
+    for(int i = 0; i < points.size() && i < markers.size(); i++){
+        QVector4D d = data.T == C3D ? points[i] - data.V : -QVector4D(data.M.row(2).toVector3D(), 0.0f);
+        QVector4D I;
+        if(!plane.intersect(Ray(points[i], d), I))
+            continue;
+
+        QVector2D position = screenPosition(data.M, I).toVector2D();
+        positions << position;
+        residuals << markers[i].toVector2D() - position;
+    }
+
+    return fitCorrectionGrid(positions, residuals, size);
+}
+
+bool CalibrationServer::touchPosition(const CalibrationData & data, const QVector4D & point, QVector4D & position)
+{
+    if(data.T == NONE)
+        return false;
+
+    Plane plane = screenPlane(data.M);
+    QVector4D d = -QVector4D(data.M.row(2).toVector3D(), 0.0f);
+
+    QVector4D I;
+    if(!plane.intersect(Ray(point, d), I))
+        return false;
+
+    position = correctedPosition(data, I);
+    return true;
+}
+
+bool CalibrationServer::paintPosition(const CalibrationData & data, const QVector4D & point, QVector4D & position)
+{
+    if(data.T != C3D)
+        return false;
+
+    Plane plane = screenPlane(data.M);
+    QVector4D d = point - data.V;
+
+    QVector4D I;
+    if(!plane.intersect(Ray(point, d), I))
+        return false;
+
+    position = correctedPosition(data, I);
+    return true;
+}
+
+CalibrationJob CalibrationServer::runCalibration(CalibrationJob job, SolverControl * control)
+{
+    CalibrationType type = job.type;
+    const QVector<QVector4D> & points = job.points;
+    const QVector<QVector4D> & markers = job.markers;
+    const QVector<double> & spreads = job.spreads;
+    QVector<int> & rejected = job.rejected;
+    QVector<double> errors;
+
     if(type == C2D){
         if(markers.size() < 3 || points.size() != markers.size())
-            return;
+            return job;
+
+        QVector<bool> inliers = findInliers(type, points, markers, control);
+
+        QVector<QVector4D> ip, im;
+        QVector<double> is;
+        for(int i = 0; i < markers.size(); i++){
+            if(inliers[i]){
+                ip << points[i];
+                im << markers[i];
+                if(!spreads.isEmpty())
+                    is << spreads[i];
+            }else{
+                rejected << i;
+            }
+        }
 
+        // the homography has no parameter vector, so there is no warm start, uncertainty or cross-validation for it
+        QElapsedTimer timer;
+        timer.start();
+        QMatrix4x4 H;
+        bool homography = homographyModel && computeHomographyMatrix(ip, im, H);
+        if(homographyModel){
+            control->record("homography", timer);
+            if(!homography)
+                qDebug() << "WARNING: The markers do not determine a homography (fewer than 4 or on one line), falling back to the rigid transformation";
+        }
 
-        QMatrix4x4 M = computeTransformationMatrixFromPoints(points, markers);
+        if(homography){
+            job.data.T = type;
+            job.data.M = H;
+            job.data.V = QVector4D(0,0,0,1);
+            job.data.P.clear();
+        }else{
+            QVector<double> P;
+            QMatrix4x4 M = computeTransformation(ip, im, is, job.stored, job.warmStart, P, control);
+
+            job.data.T = type;
+            job.data.M = M;
+            job.data.V = QVector4D(0,0,0,1);
+            job.data.P = P;
+
+            timer.start();
+            job.uncertainty = computeTransformationUncertainty(ip, im, P.data(), bootstrapSamples, control, is, correctionGridSize, solver);
+            control->record("uncertainty", timer);
+
+            timer.start();
+            errors = crossValidateTransformation(ip, im, P.data(), control, is, correctionGridSize, solver);
+            control->record("cross-validation", timer);
+        }
 
-        calibrationData.T = type;
-        calibrationData.M = M;
-        calibrationData.V = QVector4D(0,0,0,1);
+        if(correctionGridSize >= 2){
+            timer.start();
+            job.data.C = fitCorrection(job.data, ip, im, correctionGridSize);
+            control->record("correction grid", timer);
+        }
     }
 
     if(type == C3D){
         if(markers.size() < 3 || points.size() % markers.size() != 0 || points.size() / markers.size() < 2)
-            return;
+            return job;
 
         int step = points.size() / markers.size();
 
@@ -66,36 +457,298 @@ void CalibrationServer::calibrate(CalibrationType type, QVector<QVector4D> point
         for(int i = 0; i < points.size(); i+=step)
             pp << points[i];
 
-        QMatrix4x4 M = computeTransformationMatrixFromPoints(pp, markers);
+        // a rejected marker drops its first tap from the transformation and its ray from the projector position
+        QVector<bool> inliers = findInliers(type, pp, markers, control);
+
+        QElapsedTimer timer;
+        timer.start();
 
+        QVector<QVector4D> ip, im, taps;
+        QVector<double> is, tapSpreads;
         QVector<Ray> rays;
-        for(int i = 0; i < points.size(); i+=step){
-            QVector<QVector4D> rp;
-            for(int j = i; j < i + step; j++){
-                rp << points[j];
+        for(int i = 0; i < markers.size(); i++){
+            if(!inliers[i]){
+                rejected << i;
+                continue;
+            }
+
+            ip << pp[i];
+            im << markers[i];
+            if(!spreads.isEmpty())
+                is << spreads[i * step];
+
+            RayAccumulator accumulator;
+            for(int j = i * step; j < (i + 1) * step; j++){
+                accumulator.add(points[j]);
+                taps << points[j];
+                if(!spreads.isEmpty())
+                    tapSpreads << spreads[j];
             }
-            rays << Ray::fit(rp);
+            rays << accumulator.ray();
+        }
+        control->record("rays", timer);
+
+        // the separate estimates only start the joint fit of the transformation and the projector to all taps
+        QVector<double> P = initialTransformation(ip, im, is, job.stored, job.warmStart, control);
+
+        timer.start();
+        QVector4D V;
+        bool projector = computeProjectorPosition(rays, V);
+        control->record("projector position", timer);
+        if(!projector){
+            qDebug() << "ERROR: The rays of the calibration are parallel, the projector position is undetermined";
+            return job;
+        }
+
+        refineProjectiveParameters(taps, im, step, P.data(), V, 100, control, tapSpreads);
+
+        QMatrix4x4 M = createTransformationMatrix(P[0], P[1], P[2], QVector3D(P[3], P[4], P[5]), QVector3D(P[6], P[7], 1.0f));
+
+        job.data.T = type;
+        job.data.M = M;
+        job.data.V = V;
+        job.data.P = P;
+
+        timer.start();
+        job.uncertainty = computeProjectiveUncertainty(taps, im, step, P.data(), V, bootstrapSamples, control, tapSpreads, correctionGridSize);
+        control->record("uncertainty", timer);
+
+        timer.start();
+        errors = crossValidateProjective(taps, im, step, P.data(), V, control, tapSpreads, correctionGridSize);
+        control->record("cross-validation", timer);
+
+        if(correctionGridSize >= 2){
+            timer.start();
+            job.data.C = fitCorrection(job.data, ip, im, correctionGridSize);
+            control->record("correction grid", timer);
+        }
+    }
+
+    // the cross-validation ran on the inliers only, map back to the markers of the request,
+    // markers it had no time for are left out
+    for(int i = 0, j = 0; i < markers.size() && j < errors.size(); i++){
+        if(rejected.contains(i))
+            continue;
+        if(errors[j] >= 0.0)
+            job.heldOutErrors[i] = errors[j];
+        j++;
+    }
+
+    job.telemetry = control->telemetry();
+    job.valid = true;
+    return job;
+}
+
+void CalibrationServer::onSolveProgress(int iteration, double chi2)
+{
+    // the fits report every iteration, clients get a few updates per second
+    if(progressTimer.elapsed() < 100)
+        return;
+    progressTimer.restart();
+
+    broadcastMessage(createProgressResponse(iteration, chi2));
+}
+
+void CalibrationServer::onCalibrationFinished()
+{
+    QFutureWatcher<CalibrationJob> * watcher = static_cast<QFutureWatcher<CalibrationJob> *>(sender());
+    SolverControl * control = calibrationJobs.take(watcher);
+    CalibrationJob job = watcher->result();
+    watcher->deleteLater();
+    control->deleteLater();
+
+    // a cancelled or superseded calibration is discarded, one stopped by the deadline is applied with what it found
+    if(watcher != calibrationWatcher)
+        return;
+    calibrationWatcher = NULL;
+    solveControl = NULL;
+    if(!job.valid || control->isCancelled())
+        return;
+
+    if(control->expired())
+        qDebug() << "DEBUG: Calibration stopped at the deadline, applying the best parameters found";
+
+    calibrationData = job.data;
+
+    if(!dataFile.isEmpty())
+        write(dataFile);
+    writeTelemetry(job);
+
+    broadcastMessage(createCalibResponse(calibrationData, job.rejected, job.uncertainty, job.heldOutErrors, job.telemetry));
+}
+
+
+
+QVector<bool> CalibrationServer::findInliers(CalibrationType type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers, SolverControl * control)
+{
+    if(inlierThreshold <= 0.0)
+        return QVector<bool>(markers.size(), true);
+
+    // the consensus is scored with the rigid transformation, which would reject the keystoned markers the homography
+    // is there to fit and the distorted ones the correction grid is there to fix
+    if(type == C2D && homographyModel){
+        qDebug() << "DEBUG: Outlier rejection skipped, the rigid consensus cannot score a homography";
+        return QVector<bool>(markers.size(), true);
+    }
+    if(correctionGridSize >= 2){
+        qDebug() << "DEBUG: Outlier rejection skipped, the rigid consensus would reject what the correction grid fixes";
+        return QVector<bool>(markers.size(), true);
+    }
+
+    QVector<bool> inliers = findTransformationInliers(points, markers, inlierThreshold, 1000, control, solver);
+    if(inliers.count(true) < 3)
+        return QVector<bool>(markers.size(), true);
+
+    return inliers;
+}
+
+// true if not all markers lie on one line, otherwise the rotation about that line is undetermined
+static bool spansScreen(const QVector<QVector4D> & markers)
+{
+    for(int i = 2; i < markers.size(); i++){
+        QVector3D a = markers[1].toVector3D() - markers[0].toVector3D();
+        QVector3D b = markers[i].toVector3D() - markers[0].toVector3D();
+        if(QVector3D::crossProduct(a, b).length() > 0.1 * a.length() * b.length())
+            return true;
+    }
+    return false;
+}
+
+void CalibrationServer::streamPoint(QWebSocket * client, CalibrationType type, int index, int marker, const QVector4D & point, const QVector4D & markerPosition)
+{
+    if(type != C2D && type != C3D)
+        return;
+
+    if(index == 0 || type != streamType){
+        streamType = type;
+        streamPoints.clear();
+        streamMarkers.clear();
+        streamMarkerIndices.clear();
+        streamSolved = false;
+    }
+
+    // further taps on a marker of a 3D calibration only add depth, the transformation uses the first one
+    if(streamMarkerIndices.contains(marker))
+        return;
+
+    streamMarkerIndices.insert(marker);
+    streamPoints << point;
+    streamMarkers << markerPosition;
+
+    // the closed-form estimate starts the first fit, every later one continues from the previous parameters
+    if(!streamSolved){
+        if(streamMarkers.size() < 3 || !spansScreen(streamMarkers))
+            return;
+        getInitialParameters(streamPoints, streamMarkers, streamParameters);
+    }
+
+    // the provisional fit runs on the server thread between touch requests, so it stops at a short deadline
+    // with the best parameters found by then
+    static const qint64 STREAM_DEADLINE = 50;
+    SolverControl control(STREAM_DEADLINE);
+
+    double error = refineTransformationParameters(streamPoints, streamMarkers, streamParameters, 100, &control, QVector<double>(), solver);
+    streamSolved = true;
+
+    // the residual is close to 0 on 3 markers, from 4 markers on the held-out error estimates the accuracy
+    QVector<double> heldOutErrors = crossValidateTransformation(streamPoints, streamMarkers, streamParameters, &control, QVector<double>(), 0, solver);
+    double heldOutError2 = 0.0;
+    int folds = 0;
+    foreach(double heldOutError, heldOutErrors){
+        if(heldOutError >= 0.0){
+            heldOutError2 += heldOutError * heldOutError;
+            folds++;
         }
+    }
+    if(folds > 0)
+        sendMessage(client, createProvisionalResponse(streamPoints.size(), std::sqrt(heldOutError2 / folds), true));
+    else
+        sendMessage(client, createProvisionalResponse(streamPoints.size(), error, false));
+}
 
-        QVector4D V = computeProjectorPosition(rays);
+QVector<double> CalibrationServer::initialTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads,
+                                                         const CalibrationData & stored, bool warmStart, SolverControl * control)
+{
+    if(warmStart && stored.T != NONE && stored.P.size() == 8)
+        return stored.P;
+
+    QVector<double> parameters(8);
+    if(multiStartSeeds > 1){
+        computeTransformationMatrixMultiStart(points, markers, multiStartSeeds, multiStartBudget, solver, parameters.data(), control, spreads);
+    }else{
+        QElapsedTimer timer;
+        timer.start();
+        getInitialParameters(points, markers, parameters.data());
+        control->record("initial estimate", timer);
+    }
+    return parameters;
+}
+
+QMatrix4x4 CalibrationServer::computeTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads,
+                                                    const CalibrationData & stored, bool warmStart, QVector<double> & parameters, SolverControl * control)
+{
+    parameters.resize(8);
+
+    // after a minor disturbance the stored solution is close, so a few taps refine it without any search
+    if(warmStart && stored.T != NONE && stored.P.size() == 8){
+        parameters = stored.P;
+        double error = refineTransformationParameters(points, markers, parameters.data(), 100, control, spreads, solver);
+        qDebug() << "DEBUG: Warm start from stored parameters, RMS error" << error;
+        return createTransformationMatrix(parameters[0], parameters[1], parameters[2], QVector3D(parameters[3], parameters[4], parameters[5]), QVector3D(parameters[6], parameters[7], 1.0f));
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if(homographyStart && getHomographyParameters(points, markers, parameters.data())){
+        control->record("initial estimate", timer);
+        refineTransformationParameters(points, markers, parameters.data(), 100, control, spreads, solver);
+        return createTransformationMatrix(parameters[0], parameters[1], parameters[2], QVector3D(parameters[3], parameters[4], parameters[5]), QVector3D(parameters[6], parameters[7], 1.0f));
+    }
+
+    if(multiStartSeeds > 1)
+        return computeTransformationMatrixMultiStart(points, markers, multiStartSeeds, multiStartBudget, solver, parameters.data(), control, spreads);
+
+    return computeTransformationMatrixFromPoints(points, markers, solver, NULL, parameters.data(), control, spreads);
+}
 
-        calibrationData.T = type;
-        calibrationData.M = M;
-        calibrationData.V = V;
+void CalibrationServer::sendMessage(QWebSocket * client, const QString & message)
+{
+    if(!batchingClients.contains(client)){
+        client->sendTextMessage(message);
+        return;
     }
 
-    write("s.dat");
+    // responses produced in the current event loop iteration are sent together in one frame
+    if(pendingMessages.isEmpty())
+        QTimer::singleShot(0, this, SLOT(flushMessages()));
 
-    broadcastMessage(createCalibResponse(calibrationData));
+    pendingMessages[client] << message;
 }
 
 void CalibrationServer::broadcastMessage(const QString & message)
 { 
     foreach(QWebSocket * client, clients){
-        client->sendTextMessage(message);
+        sendMessage(client, message);
     }
 }
 
+void CalibrationServer::flushMessages()
+{
+    QHash<QWebSocket *, QStringList>::const_iterator it;
+    for(it = pendingMessages.constBegin(); it != pendingMessages.constEnd(); ++it)
+        sendFrame(it.key(), it.value());
+    pendingMessages.clear();
+}
+
+void CalibrationServer::sendFrame(QWebSocket * client, const QStringList & messages)
+{
+    // a single response goes out as is, so a client sees the same framing with and without batching
+    if(messages.size() == 1)
+        client->sendTextMessage(messages.first());
+    else
+        client->sendTextMessage(createBatchMessage(messages));
+}
+
 void CalibrationServer::onNewConnection()
 {
     QWebSocket * socket = nextPendingConnection();
@@ -111,40 +764,51 @@ void CalibrationServer::onNewConnection()
 
 void CalibrationServer::processTextMessage(const QString & message)
 {   
-    QVector4D o, d, I;
+    QVector4D o, d, I, m;
     CalibrationType type;
     QVector<QVector4D> points, markers;
-
-    if(parseCalibRequest(message, type, points, markers)){
-        calibrate(type, points, markers);
+    QVector<double> spreads;
+    bool batch, warmStart;
+    int index, marker;
+
+    if(parseBatchRequest(message, batch)){                                      // BATCH
+        QWebSocket * client = dynamic_cast<QWebSocket *>(QObject::sender());
+        if(batch){
+            batchingClients.insert(client);
+        }else{
+            batchingClients.remove(client);
+            if(pendingMessages.contains(client))
+                sendFrame(client, pendingMessages.take(client));
+        }
+    }else if(parseCancelRequest(message)){
+        cancelCalibration();
+    }else if(parseCalibRequest(message, type, points, markers, warmStart, spreads)){
+        calibrate(type, points, markers, spreads, warmStart);
+    }else if(parseStreamRequest(message, type, index, marker, o, m)){
+        QWebSocket * client = dynamic_cast<QWebSocket *>(QObject::sender());
+        streamPoint(client, type, index, marker, o, m);
     }else if(parseTouchRequest(message, o) && calibrationData.T != NONE){              // TOUCH
-        Plane screenPlane(calibrationData.M.inverted() * QVector4D(0,0,0,1), calibrationData.M.inverted() * QVector4D(0,0,1,0));
-        d = -(calibrationData.M.inverted() * QVector4D(0,0,1,0));
-
         // intersect with screen plane
-        if(screenPlane.intersect(Ray(o, d), I)){
+        if(touchPosition(calibrationData, o, I)){
             // send point of intersection
             QWebSocket * client = dynamic_cast<QWebSocket *>(QObject::sender());
-            client->sendTextMessage(createTouchResponse(calibrationData.M * I));
+            sendMessage(client, createTouchResponse(I));
         }
     } else if(parsePointRequest(message, o, d) && calibrationData.T != NONE){    // POINT
-        Plane screenPlane(calibrationData.M.inverted() * QVector4D(0,0,0,1), calibrationData.M.inverted() * QVector4D(0,0,1,0));
+        Plane plane = screenPlane(calibrationData.M);
 
         // intersect with screen plane
-        if(screenPlane.intersect(Ray(o, d), I)){
+        if(plane.intersect(Ray(o, d), I)){
             // send point of intersection
             QWebSocket * client = dynamic_cast<QWebSocket *>(QObject::sender());
-            client->sendTextMessage(createPointResponse(calibrationData.M * I));
+            sendMessage(client, createPointResponse(correctedPosition(calibrationData, I)));
         }
     } else if(parsePaintRequest(message, o) && calibrationData.T == C3D){       // PAINT
-        Plane screenPlane(calibrationData.M.inverted() * QVector4D(0,0,0,1), calibrationData.M.inverted() * QVector4D(0,0,1,0));
-        d = o - calibrationData.V;
-
         // intersect with screen plane
-        if(screenPlane.intersect(Ray(o, d), I)){
+        if(paintPosition(calibrationData, o, I)){
             // send point of intersection
             QWebSocket * client = dynamic_cast<QWebSocket *>(QObject::sender());
-            client->sendTextMessage(createPaintResponse(calibrationData.M * I));
+            sendMessage(client, createPaintResponse(I));
         }
     }
 }
@@ -158,6 +822,8 @@ void CalibrationServer::onConnectionClose()
     QWebSocket * client = qobject_cast<QWebSocket *>(sender());
     if(client){
         clients.removeAll(client);
+        batchingClients.remove(client);
+        pendingMessages.remove(client);
         client->deleteLater();
     }
 }
@@ -4,32 +4,148 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
 
 #include <QWebSocketServer>
+#include <QHostAddress>
 #include <QWebSocket>
 #include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QStringList>
+#include <QFutureWatcher>
+#include <QElapsedTimer>
 
 #include <cmath>
 
 #include "calibrationdata.h"
 
+// threshold of the outlier rejection in pixels when it is enabled without one, see CalibrationServer::setInlierThreshold
+const double DEFAULT_INLIER_THRESHOLD = 50.0;
+
+// A calibration request and its result, solved off the event loop
+struct CalibrationJob
+{
+    CalibrationJob();
+
+    CalibrationType type;
+    QVector<QVector4D> points, markers;
+    QVector<double> spreads;    // standard error of every point, empty for an unweighted fit
+    bool warmStart;
+    CalibrationData stored;     // the calibration when the request arrived, a warm start continues from it
+
+    bool valid;
+    CalibrationData data;
+    QVector<int> rejected;
+    CalibrationUncertainty uncertainty;
+    QMap<int, double> heldOutErrors;
+    QVector<SolveStage> telemetry;
+};
+
 class CalibrationServer: public QWebSocketServer
 {
     Q_OBJECT
 public:
-    CalibrationServer();
+    // the calibration is loaded from dataFile and saved to it whenever it changes, an empty name keeps it in memory only
+    explicit CalibrationServer(const QString & dataFile = "s.dat");
     virtual ~CalibrationServer();
 
+    // low-latency tuning, applied to the listening socket by listenTuned() and inherited by accepted connections
+    void setLowDelay(bool enabled);
+    void setSendBufferSize(int size);
+    void setReceiveBufferSize(int size);
+    bool setCpuAffinity(int cpu);
+
+    // listen() with the socket options above, QWebSocketServer::listen is not virtual and ignores them
+    bool listenTuned(const QHostAddress & address = QHostAddress::Any, quint16 port = 0);
+
+    // solver of the screen transformation fits, LEVMAR (Euler angles) by default
+    void setSolver(SolverType type);
+
+    // refine the screen transformation from several seeds in parallel, seeds <= 1 disables the search
+    void setMultiStart(int seeds, int timeBudget);
+
+    // taps farther than threshold px from their marker are rejected and reported, 0 (the default) disables it
+    void setInlierThreshold(double threshold);
+
+    // homography model for 2D calibrations of 4+ markers, or with start only as the start of the rigid fit
+    void setHomography(bool enabled, bool start);
+
+    // size x size grid correcting the residuals at the markers, 0 disables it
+    void setCorrectionGrid(int size);
+
+    // uncertainty from the covariance of the fit or, with samples > 1, from that many bootstrap refits
+    void setBootstrap(int samples);
+
+    // a calibration stops after deadline ms and applies the best parameters found so far, 0 for no deadline
+    void setSolveDeadline(int deadline);
+
+    // appends the telemetry of every applied calibration to filename, rotated at 1 MB, empty disables it
+    void setTelemetryLog(const QString & filename);
+
+    // runs the calibration pipeline with the current settings on the calling thread, the result is neither applied nor broadcast
+    CalibrationJob solveCalibration(CalibrationType type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers,
+                                    const QVector<double> & spreads = QVector<double>());
+
+    // position a touch or paint request at point is answered with, false if it misses the screen
+    static bool touchPosition(const CalibrationData & data, const QVector4D & point, QVector4D & position);
+    static bool paintPosition(const CalibrationData & data, const QVector4D & point, QVector4D & position);
+
 private:
     void write(QString filename);
     void read(QString filename);
+    void writeTelemetry(const CalibrationJob & job);
 
+    void sendMessage(QWebSocket * client, const QString & message);
     void broadcastMessage(const QString & message);
-    void calibrate(CalibrationType type, QVector<QVector4D> points, QVector<QVector4D> markers);
+    void calibrate(CalibrationType type, QVector<QVector4D> points, QVector<QVector4D> markers, QVector<double> spreads, bool warmStart);
+    void cancelCalibration();
+    // run in a worker thread, only reads the settings of the server
+    CalibrationJob runCalibration(CalibrationJob job, SolverControl * control);
+    QVector<double> initialTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads,
+                                          const CalibrationData & stored, bool warmStart, SolverControl * control);
+    QMatrix4x4 computeTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads,
+                                     const CalibrationData & stored, bool warmStart, QVector<double> & parameters, SolverControl * control);
+    QVector<bool> findInliers(CalibrationType type, const QVector<QVector4D> & points, const QVector<QVector4D> & markers, SolverControl * control);
+    void sendFrame(QWebSocket * client, const QStringList & messages);
+    void streamPoint(QWebSocket * client, CalibrationType type, int index, int marker, const QVector4D & point, const QVector4D & markerPosition);
 
+    QString dataFile;
+    bool lowDelay;
+    int sendBufferSize;
+    int receiveBufferSize;
     CalibrationData calibrationData;
     QList<QWebSocket *> clients;
 
+    // clients that asked for their responses to be coalesced and the responses waiting for the next flush
+    QSet<QWebSocket *> batchingClients;
+    QHash<QWebSocket *, QStringList> pendingMessages;
+
+    SolverType solver;
+    int multiStartSeeds;
+    int multiStartBudget;
+    double inlierThreshold;
+    int bootstrapSamples;
+    int solveDeadline;
+    bool homographyModel;
+    bool homographyStart;
+    int correctionGridSize;
+    QString telemetryLog;
+
+    // the calibration being solved and every job still running with its control, superseded ones are discarded
+    QFutureWatcher<CalibrationJob> * calibrationWatcher;
+    SolverControl * solveControl;
+    QHash<QFutureWatcher<CalibrationJob> *, SolverControl *> calibrationJobs;
+    QElapsedTimer progressTimer;
+
+    // streamed calibration, the first tap on every marker, and its provisional fit
+    CalibrationType streamType;
+    QVector<QVector4D> streamPoints, streamMarkers;
+    QSet<int> streamMarkerIndices;
+    double streamParameters[8];
+    bool streamSolved;
+
 signals:
 
 private slots:
@@ -37,6 +153,9 @@ private slots:
     void processTextMessage(const QString & message);
     void processBinaryMessage(const QByteArray & message);
     void onConnectionClose();
+    void flushMessages();
+    void onSolveProgress(int iteration, double chi2);
+    void onCalibrationFinished();
 };
 
 
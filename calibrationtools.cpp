@@ -1,4 +1,57 @@
 #include "calibrationtools.h"
+#include <algorithm>
+
+#include <QtConcurrent/QtConcurrentMap>
+
+SolverControl::SolverControl(qint64 deadline, QObject * parent)
+    :QObject(parent), cancelled(0), deadline(deadline)
+{
+    timer.start();
+}
+
+void SolverControl::cancel()
+{
+    cancelled.store(1);
+}
+
+bool SolverControl::isCancelled() const
+{
+    return cancelled.load() != 0;
+}
+
+bool SolverControl::expired() const
+{
+    return isCancelled() || (deadline >= 0 && timer.elapsed() > deadline);
+}
+
+bool SolverControl::iteration(int iter, double chi2)
+{
+    emit progress(iter, chi2);
+    return !expired();
+}
+
+void SolverControl::record(const QString & stage, const QElapsedTimer & timer, const LMResult * result)
+{
+    SolveStage s;
+    s.name = stage;
+    s.time = timer.nsecsElapsed() / 1e6;
+    if(result){
+        s.niter = result->niter;
+        s.nfev = result->nfev;
+        s.status = result->status;
+        s.orignorm = result->orignorm;
+        s.bestnorm = result->bestnorm;
+    }
+
+    QMutexLocker locker(&mutex);
+    stages << s;
+}
+
+QVector<SolveStage> SolverControl::telemetry() const
+{
+    QMutexLocker locker(&mutex);
+    return stages;
+}
 
 Ray::Ray()
 {
@@ -35,42 +88,127 @@ bool Ray::closestPoint(const Ray & ray, QVector4D & point) const
     return true;
 }
 
-int errorFuncRay(int m, int /*n*/, double *p, double *deviates, double ** /*derivs*/, void *vars)
+// Eigen decomposition of a symmetric n x n matrix A (row-major, destroyed) by cyclic Jacobi rotations,
+// eigenvectors are stored in the columns of V
+static void jacobiEigen(int n, double * A, double * eigenvalues, double * V)
 {
-    QVector3D origin(p[0], p[1], p[2]);
-    QVector3D direction(p[3], p[4], p[5]);
-    direction.normalize();
+    for(int i = 0; i < n; i++)
+        for(int j = 0; j < n; j++)
+            V[i*n+j] = i == j ? 1.0 : 0.0;
+
+    for(int sweep = 0; sweep < 50; sweep++){
+        double off = 0.0, diagonal = 0.0;
+        for(int i = 0; i < n; i++){
+            diagonal += A[i*n+i] * A[i*n+i];
+            for(int j = i + 1; j < n; j++)
+                off += A[i*n+j] * A[i*n+j];
+        }
+        if(off <= 1e-30 * diagonal)
+            break;
+
+        for(int p = 0; p < n; p++){
+            for(int q = p + 1; q < n; q++){
+                if(A[p*n+q] == 0.0)
+                    continue;
+
+                double theta = (A[q*n+q] - A[p*n+p]) / (2.0 * A[p*n+q]);
+                double t = (theta >= 0.0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+
+                for(int k = 0; k < n; k++){
+                    double akp = A[k*n+p], akq = A[k*n+q];
+                    A[k*n+p] = c * akp - s * akq;
+                    A[k*n+q] = s * akp + c * akq;
+                }
+                for(int k = 0; k < n; k++){
+                    double apk = A[p*n+k], aqk = A[q*n+k];
+                    A[p*n+k] = c * apk - s * aqk;
+                    A[q*n+k] = s * apk + c * aqk;
+                }
+                for(int k = 0; k < n; k++){
+                    double vkp = V[k*n+p], vkq = V[k*n+q];
+                    V[k*n+p] = c * vkp - s * vkq;
+                    V[k*n+q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
 
-    QVector<QVector4D> * v = (QVector<QVector4D> *) vars;
+    for(int i = 0; i < n; i++)
+        eigenvalues[i] = A[i*n+i];
+}
 
-    for(int i = 0, j = 0; i < m; i++, j++){
-        QVector3D point = (*v)[j].toVector3D();
-        QVector3D pt = (origin-point) - (QVector3D::dotProduct((origin-point), direction)) * direction;
-        deviates[i]   = pt.x();
-        deviates[++i] = pt.y();
-        deviates[++i] = pt.z();
+RayAccumulator::RayAccumulator()
+    :n(0), first(), last()
+{
+    for(int i = 0; i < 3; i++)
+        mean[i] = 0.0;
+    for(int i = 0; i < 9; i++)
+        scatter[i] = 0.0;
+}
+
+void RayAccumulator::add(const QVector4D &point)
+{
+    // running mean and scatter matrix (Welford update)
+    n++;
+    double delta[3];
+    for(int k = 0; k < 3; k++){
+        delta[k] = point[k] - mean[k];
+        mean[k] += delta[k] / n;
     }
-    return 0;
+    for(int k = 0; k < 3; k++)
+        for(int l = 0; l < 3; l++)
+            scatter[k*3+l] += delta[k] * (point[l] - mean[l]);
+
+    if(n == 1)
+        first = point;
+    last = point;
 }
 
-Ray Ray::fit(const QVector<QVector4D> &points)
+void RayAccumulator::clear()
 {
-    // initial estimate
-    QVector4D origin = points[0];
-    QVector4D direction = (points[1] - points[0]).normalized();
-    double x[] = {origin.x(), origin.y(), origin.z(), direction.x(), direction.y(), direction.z()};
+    *this = RayAccumulator();
+}
 
-    mp_config config;
-    memset(&config, 0, sizeof(config));
-    config.maxfev = 100000;
-    config.maxiter = 100000;
+int RayAccumulator::size() const
+{
+    return n;
+}
+
+Ray RayAccumulator::ray() const
+{
+    QVector4D origin(mean[0], mean[1], mean[2], 1.0);
+    if(n < 2)
+        return Ray(origin, QVector4D(0.0, 0.0, 1.0, 0.0));
+
+    // least-squares line passes through the centroid along the principal axis of the scatter matrix
+    double A[9], eigenvalues[3], eigenvectors[9];
+    for(int i = 0; i < 9; i++)
+        A[i] = scatter[i];
+    jacobiEigen(3, A, eigenvalues, eigenvectors);
 
-    mp_result result;
-    memset(&result, 0, sizeof(result));
+    int largest = 0;
+    for(int i = 1; i < 3; i++)
+        if(eigenvalues[i] > eigenvalues[largest])
+            largest = i;
 
-    mpfit(errorFuncRay, points.size()*3, sizeof(x)/sizeof(x[0]), x, NULL, &config, (void*)&points, &result);
+    QVector4D direction(eigenvectors[0*3+largest], eigenvectors[1*3+largest], eigenvectors[2*3+largest], 0.0);
 
-    return Ray(QVector4D(x[0], x[1], x[2], 1.0), QVector4D(x[3], x[4], x[5], 0.0));
+    // orient the ray in the order the points were added
+    if(QVector4D::dotProduct(direction, last - first) < 0)
+        direction = -direction;
+
+    return Ray(origin, direction);
+}
+
+Ray Ray::fit(const QVector<QVector4D> &points)
+{
+    RayAccumulator accumulator;
+    foreach(QVector4D point, points)
+        accumulator.add(point);
+
+    return accumulator.ray();
 }
 
 QMatrix4x4 createTransformationMatrix(float alpha, float beta, float gamma, QVector3D translationVector, QVector3D scalingVector)
@@ -87,149 +225,745 @@ QMatrix4x4 createTransformationMatrix(float alpha, float beta, float gamma, QVec
     return M;
 }
 
-void getInitialEstimates(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, QVector3D &rotation, QVector3D &translation, float &scale)
+static void multiply(const double A[3][3], const double B[3][3], double C[3][3])
 {
-    // SCALE ESTIMATE
-    // Scale is the ratio of lengths of corresponding vectors
+    for(int k = 0; k < 3; k++)
+        for(int l = 0; l < 3; l++)
+            C[k][l] = A[k][0]*B[0][l] + A[k][1]*B[1][l] + A[k][2]*B[2][l];
+}
+
+// Rotation part of createTransformationMatrix, R = Rx(-alpha) * Ry(-beta) * Rz(-gamma),
+// and its derivatives with respect to alpha, beta and gamma
+static void rotationMatrix(double alpha, double beta, double gamma, double R[3][3], double dR[3][3][3])
+{
+    double ca = cos(-alpha), sa = sin(-alpha);
+    double cb = cos(-beta),  sb = sin(-beta);
+    double cg = cos(-gamma), sg = sin(-gamma);
+
+    double Rx[3][3] = {{1, 0, 0}, {0, ca, -sa}, {0, sa, ca}};
+    double Ry[3][3] = {{cb, 0, sb}, {0, 1, 0}, {-sb, 0, cb}};
+    double Rz[3][3] = {{cg, -sg, 0}, {sg, cg, 0}, {0, 0, 1}};
+
+    // d/dalpha Rx(-alpha) = -Rx'(-alpha), the same holds for the other two axes
+    double dRx[3][3] = {{0, 0, 0}, {0, sa, ca}, {0, -ca, sa}};
+    double dRy[3][3] = {{sb, 0, -cb}, {0, 0, 0}, {cb, 0, sb}};
+    double dRz[3][3] = {{sg, cg, 0}, {-cg, sg, 0}, {0, 0, 0}};
+
+    double T[3][3];
+    multiply(Rx, Ry, T);  multiply(T, Rz, R);
+    multiply(dRx, Ry, T); multiply(T, Rz, dR[0]);
+    multiply(Rx, dRy, T); multiply(T, Rz, dR[1]);
+    multiply(Rx, Ry, T);  multiply(T, dRz, dR[2]);
+}
+
+// Inverse of rotationMatrix, the angles with R = Rx(-alpha) * Ry(-beta) * Rz(-gamma)
+static void eulerAngles(const double R[3][3], double angles[3])
+{
+    angles[0] = -atan2(-R[1][2], R[2][2]);
+    angles[1] = -asin(qBound(-1.0, R[0][2], 1.0));
+    angles[2] = -atan2(-R[0][1], R[0][0]);
+}
+
+// R = exp([w]x), the rotation by |w| radians about w (Rodrigues' formula)
+static void rotationVectorToMatrix(const double w[3], double R[3][3])
+{
+    double theta2 = w[0]*w[0] + w[1]*w[1] + w[2]*w[2];
+    double theta = sqrt(theta2);
+
+    // sin(theta) / theta and (1 - cos(theta)) / theta^2, by their series for small angles
+    double a, b;
+    if(theta < 1e-4){
+        a = 1.0 - theta2 / 6.0;
+        b = 0.5 - theta2 / 24.0;
+    }else{
+        a = sin(theta) / theta;
+        b = (1.0 - cos(theta)) / theta2;
+    }
 
-    scale = (markers[1] - markers[0]).length() / (points[1] - points[0]).length();
+    double W[3][3] = {{0.0, -w[2], w[1]}, {w[2], 0.0, -w[0]}, {-w[1], w[0], 0.0}};
+    double W2[3][3];
+    multiply(W, W, W2);
+
+    for(int k = 0; k < 3; k++)
+        for(int l = 0; l < 3; l++)
+            R[k][l] = (k == l ? 1.0 : 0.0) + a * W[k][l] + b * W2[k][l];
+}
+
+// Inverse of rotationVectorToMatrix, through the unit quaternion of R so it stays accurate up to 180 degrees
+static void matrixToRotationVector(const double R[3][3], double w[3])
+{
+    double q[4];
+    double trace = R[0][0] + R[1][1] + R[2][2];
+
+    if(trace > 0.0){
+        double r = sqrt(1.0 + trace) * 2.0;
+        q[0] = 0.25 * r;
+        q[1] = (R[2][1] - R[1][2]) / r;
+        q[2] = (R[0][2] - R[2][0]) / r;
+        q[3] = (R[1][0] - R[0][1]) / r;
+    }else if(R[0][0] > R[1][1] && R[0][0] > R[2][2]){
+        double r = sqrt(1.0 + R[0][0] - R[1][1] - R[2][2]) * 2.0;
+        q[0] = (R[2][1] - R[1][2]) / r;
+        q[1] = 0.25 * r;
+        q[2] = (R[0][1] + R[1][0]) / r;
+        q[3] = (R[0][2] + R[2][0]) / r;
+    }else if(R[1][1] > R[2][2]){
+        double r = sqrt(1.0 + R[1][1] - R[0][0] - R[2][2]) * 2.0;
+        q[0] = (R[0][2] - R[2][0]) / r;
+        q[1] = (R[0][1] + R[1][0]) / r;
+        q[2] = 0.25 * r;
+        q[3] = (R[1][2] + R[2][1]) / r;
+    }else{
+        double r = sqrt(1.0 + R[2][2] - R[0][0] - R[1][1]) * 2.0;
+        q[0] = (R[1][0] - R[0][1]) / r;
+        q[1] = (R[0][2] + R[2][0]) / r;
+        q[2] = (R[1][2] + R[2][1]) / r;
+        q[3] = 0.25 * r;
+    }
+
+    if(q[0] < 0.0)
+        for(int k = 0; k < 4; k++)
+            q[k] = -q[k];
+
+    double sinHalf = sqrt(q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    double scale = sinHalf < 1e-12 ? 2.0 : 2.0 * atan2(sinHalf, q[0]) / sinHalf;
+    for(int k = 0; k < 3; k++)
+        w[k] = scale * q[k + 1];
+}
+
+// Closed-form least-squares scale and translation of the screen transformation for a fixed rotation R
+static void scaleAndTranslation(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, const double R[3][3], double s[2], double t[3])
+{
+    int n = qMin(points.size(), markers.size());
+
+    double pc[3] = {0.0, 0.0, 0.0}, mc[3] = {0.0, 0.0, 0.0};
+    for(int i = 0; i < n; i++){
+        for(int k = 0; k < 3; k++){
+            pc[k] += points[i][k] / n;
+            mc[k] += markers[i][k] / n;
+        }
+    }
+
+    // SCALE ESTIMATE
+    // least-squares scale of each screen axis for the given rotation
+    double sxx = 0.0, sxm = 0.0, syy = 0.0, sym = 0.0;
+    for(int i = 0; i < n; i++){
+        double q[3] = {points[i].x() - pc[0], points[i].y() - pc[1], points[i].z() - pc[2]};
+        double rx = R[0][0]*q[0] + R[0][1]*q[1] + R[0][2]*q[2];
+        double ry = R[1][0]*q[0] + R[1][1]*q[1] + R[1][2]*q[2];
+        sxx += rx * rx; sxm += rx * (markers[i].x() - mc[0]);
+        syy += ry * ry; sym += ry * (markers[i].y() - mc[1]);
+    }
+    s[0] = sxx > 0.0 && sxm != 0.0 ? sxm / sxx : 1.0;
+    s[1] = syy > 0.0 && sym != 0.0 ? sym / syy : 1.0;
 
     // TRANSLATION ESTIMATE
-    // Translation vector is the position of screen origin in Leap coordinates
-    QVector3D x(1.0f, 0.0f, 0.0f);
-    QVector3D y(0.0f, 1.0f, 0.0f);
-    QVector3D z(0.0f, 0.0f, 1.0f);
-
-    QVector3D m1 = markers[0].toVector3D();
-    QVector3D m2 = markers[1].toVector3D();
-
-    QVector3D r = (m2 - m1);
-    QVector3D s; int i;
-    for(i = 2; i < markers.size(); i++){
-            s = markers[i].toVector3D() - m1;
-            if(0.5 * QVector3D::crossProduct(r,s).length() > 0){ // points collinearity test
-                    break;
-            }
+    // centroids correspond, mc = S * R * (pc - t) with the marker centroid lying in the screen plane
+    double u[3] = {mc[0] / s[0], mc[1] / s[1], 0.0};
+    for(int k = 0; k < 3; k++)
+        t[k] = pc[k] - (R[0][k]*u[0] + R[1][k]*u[1] + R[2][k]*u[2]);
+}
+
+void getInitialEstimates(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, QVector3D &rotation, QVector3D &translation, QVector2D &scale)
+{
+    // Closed-form least-squares estimate using all point/marker pairs:
+    // rotation by Horn's quaternion method, then per-axis scale and translation for the fixed rotation.
+    int n = qMin(points.size(), markers.size());
+
+    // CENTROIDS
+    double pc[3] = {0.0, 0.0, 0.0}, mc[3] = {0.0, 0.0, 0.0};
+    for(int i = 0; i < n; i++){
+        for(int k = 0; k < 3; k++){
+            pc[k] += points[i][k] / n;
+            mc[k] += markers[i][k] / n;
+        }
     }
 
-    r.normalize();
-    s.normalize();
+    // ROTATION ESTIMATE
+    // S[a][b] = sum of (point - pc)[a] * (marker - mc)[b]
+    double S[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+    for(int i = 0; i < n; i++)
+        for(int a = 0; a < 3; a++)
+            for(int b = 0; b < 3; b++)
+                S[a][b] += (points[i][a] - pc[a]) * (markers[i][b] - mc[b]);
+
+    // the unit quaternion rotating points onto markers is the eigenvector of N with the largest eigenvalue
+    double N[16] = {
+        S[0][0] + S[1][1] + S[2][2], S[1][2] - S[2][1],            S[2][0] - S[0][2],            S[0][1] - S[1][0],
+        S[1][2] - S[2][1],           S[0][0] - S[1][1] - S[2][2],  S[0][1] + S[1][0],            S[2][0] + S[0][2],
+        S[2][0] - S[0][2],           S[0][1] + S[1][0],           -S[0][0] + S[1][1] - S[2][2],  S[1][2] + S[2][1],
+        S[0][1] - S[1][0],           S[2][0] + S[0][2],            S[1][2] + S[2][1],           -S[0][0] - S[1][1] + S[2][2]
+    };
+    double eigenvalues[4], eigenvectors[16];
+    jacobiEigen(4, N, eigenvalues, eigenvectors);
+
+    int largest = 0;
+    for(int i = 1; i < 4; i++)
+        if(eigenvalues[i] > eigenvalues[largest])
+            largest = i;
+
+    double qw = eigenvectors[0*4+largest], qx = eigenvectors[1*4+largest], qy = eigenvectors[2*4+largest], qz = eigenvectors[3*4+largest];
+    double R[3][3] = {
+        {1.0 - 2.0*(qy*qy + qz*qz), 2.0*(qx*qy - qw*qz),       2.0*(qx*qz + qw*qy)},
+        {2.0*(qx*qy + qw*qz),       1.0 - 2.0*(qx*qx + qz*qz), 2.0*(qy*qz - qw*qx)},
+        {2.0*(qx*qz - qw*qy),       2.0*(qy*qz + qw*qx),       1.0 - 2.0*(qx*qx + qy*qy)}
+    };
+
+    double angles[3], s[2], t[3];
+    scaleAndTranslation(points, markers, R, s, t);
+    eulerAngles(R, angles);
+
+    rotation = QVector3D(angles[0], angles[1], angles[2]);
+    translation = QVector3D(t[0], t[1], t[2]);
+    scale = QVector2D(s[0], s[1]);
+}
 
-    float alpha = acos(QVector3D::dotProduct(r,x));
-    float beta = acos(QVector3D::dotProduct(r,y));
+// Plane-to-screen homography of the pairs: the points are projected onto their least-squares plane through o
+// with the orthonormal right-handed basis u, v, n, and H maps plane coordinates (u.(p - o), v.(p - o), 1) to markers
+static bool fitHomography(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, double o[3], double u[3], double v[3], double n[3], double H[3][3])
+{
+    int count = qMin(points.size(), markers.size());
+    if(count < 4)
+        return false;
 
-    // direction rotation compensation
-    if(QVector3D::crossProduct(r,s).normalized() == QVector3D(0.0f,0.0f,-1.0f)){
-            alpha = -alpha;
-            beta = -beta;
+    // PLANE
+    // through the centroid, normal to the direction of least variance
+    double mc[2] = {0.0, 0.0};
+    for(int k = 0; k < 3; k++)
+        o[k] = 0.0;
+    for(int i = 0; i < count; i++){
+        for(int k = 0; k < 3; k++)
+            o[k] += points[i][k] / count;
+        mc[0] += markers[i].x() / count;
+        mc[1] += markers[i].y() / count;
     }
 
-    // quadrant compensation
-    if(m2.x() < m1.x()){
-            beta = -beta;
+    double C[9] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    for(int i = 0; i < count; i++)
+        for(int a = 0; a < 3; a++)
+            for(int b = 0; b < 3; b++)
+                C[a*3+b] += (points[i][a] - o[a]) * (points[i][b] - o[b]);
+
+    double eigenvalues[3], eigenvectors[9];
+    jacobiEigen(3, C, eigenvalues, eigenvectors);
+
+    int order[3] = {0, 1, 2};
+    for(int i = 0; i < 3; i++)
+        for(int j = i + 1; j < 3; j++)
+            if(eigenvalues[order[j]] > eigenvalues[order[i]])
+                std::swap(order[i], order[j]);
+
+    // collinear points span no plane
+    if(eigenvalues[order[1]] <= 1e-6 * eigenvalues[order[0]])
+        return false;
+
+    // collinear markers would give a singular homography that maps the whole plane onto their line
+    double S[3] = {0.0, 0.0, 0.0};
+    for(int i = 0; i < count; i++){
+        double dx = markers[i].x() - mc[0], dy = markers[i].y() - mc[1];
+        S[0] += dx * dx;
+        S[1] += dx * dy;
+        S[2] += dy * dy;
     }
+    if(S[0] * S[2] - S[1] * S[1] <= 1e-6 * (S[0] + S[2]) * (S[0] + S[2]))
+        return false;
 
-    if(m2.y() > m1.y()){
-            alpha = - alpha;
+    for(int k = 0; k < 3; k++){
+        u[k] = eigenvectors[k*3+order[0]];
+        v[k] = eigenvectors[k*3+order[1]];
+    }
+    n[0] = u[1]*v[2] - u[2]*v[1];
+    n[1] = u[2]*v[0] - u[0]*v[2];
+    n[2] = u[0]*v[1] - u[1]*v[0];
+
+    // NORMALIZATION
+    // plane coordinates and markers scaled to a mean distance of sqrt(2) from their centroids, which keeps the DLT well conditioned
+    QVector<double> a(count), b(count);
+    double pd = 0.0, md = 0.0;
+    for(int i = 0; i < count; i++){
+        double q[3] = {points[i].x() - o[0], points[i].y() - o[1], points[i].z() - o[2]};
+        a[i] = u[0]*q[0] + u[1]*q[1] + u[2]*q[2];
+        b[i] = v[0]*q[0] + v[1]*q[1] + v[2]*q[2];
+        pd += sqrt(a[i]*a[i] + b[i]*b[i]) / count;
+        md += sqrt(pow(markers[i].x() - mc[0], 2) + pow(markers[i].y() - mc[1], 2)) / count;
+    }
+    if(pd <= 0.0 || md <= 0.0)
+        return false;
+    double ps = sqrt(2.0) / pd, ms = sqrt(2.0) / md;
+
+    // DLT
+    // every pair gives two rows of A h = 0, h is the eigenvector of A^T A with the smallest eigenvalue
+    double AtA[81], dltValues[9], dltVectors[81];
+    std::fill(AtA, AtA + 81, 0.0);
+    for(int i = 0; i < count; i++){
+        double x = ps * a[i], y = ps * b[i];
+        double X = ms * (markers[i].x() - mc[0]), Y = ms * (markers[i].y() - mc[1]);
+        double rows[2][9] = {{-x, -y, -1.0, 0.0, 0.0, 0.0, X*x, X*y, X},
+                             {0.0, 0.0, 0.0, -x, -y, -1.0, Y*x, Y*y, Y}};
+        for(int r = 0; r < 2; r++)
+            for(int j = 0; j < 9; j++)
+                for(int k = j; k < 9; k++)
+                    AtA[j*9+k] += rows[r][j] * rows[r][k];
+    }
+    for(int j = 0; j < 9; j++)
+        for(int k = 0; k < j; k++)
+            AtA[j*9+k] = AtA[k*9+j];
+
+    jacobiEigen(9, AtA, dltValues, dltVectors);
+    int smallest = 0;
+    for(int i = 1; i < 9; i++)
+        if(dltValues[i] < dltValues[smallest])
+            smallest = i;
+
+    // undo the normalization, H = Tm^-1 * Hn * diag(ps, ps, 1)
+    double Hn[3][3];
+    for(int j = 0; j < 9; j++)
+        Hn[j / 3][j % 3] = dltVectors[j*9+smallest];
+    for(int k = 0; k < 3; k++){
+        double scale = k < 2 ? ps : 1.0;
+        H[0][k] = (Hn[0][k] / ms + mc[0] * Hn[2][k]) * scale;
+        H[1][k] = (Hn[1][k] / ms + mc[1] * Hn[2][k]) * scale;
+        H[2][k] = Hn[2][k] * scale;
     }
 
-    //get axis of rotation n
-    QVector3D p1 = points[0].toVector3D();
-    QVector3D p2 = points[1].toVector3D();
-    QVector3D p3 = points[i].toVector3D();
+    // the centroid of the points has to map to a finite screen position
+    if(fabs(H[2][2]) < 1e-12)
+        return false;
+    double h = H[2][2];
+    for(int j = 0; j < 3; j++)
+        for(int k = 0; k < 3; k++)
+            H[j][k] /= h;
 
-    QVector3D u = (p2 - p1).normalized();
-    QVector3D v = (p3 - p1).normalized();
+    return true;
+}
 
-    QVector3D n = QVector3D::crossProduct(u,v).normalized();
+// M maps a point to homogeneous screen coordinates, its third row is the distance from the plane and the screen
+// position is divided by w
+bool computeHomographyMatrix(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, QMatrix4x4 &M)
+{
+    double o[3], u[3], v[3], n[3], H[3][3];
+    if(!fitHomography(points, markers, o, u, v, n, H))
+        return false;
 
-    // get horizontal and vertical axis in Leap coordinate space
-    QQuaternion q1 = QQuaternion::fromAxisAndAngle(n, alpha * 180.0f / M_PI);
-    QQuaternion q2 = QQuaternion::fromAxisAndAngle(n, beta * 180.0f / M_PI);
+    // Leap space to plane coordinates and the distance from the plane, followed by the homography,
+    // which leaves the distance in the third row untouched
+    QMatrix4x4 plane(u[0], u[1], u[2], -(u[0]*o[0] + u[1]*o[1] + u[2]*o[2]),
+                     v[0], v[1], v[2], -(v[0]*o[0] + v[1]*o[1] + v[2]*o[2]),
+                     n[0], n[1], n[2], -(n[0]*o[0] + n[1]*o[1] + n[2]*o[2]),
+                     0.0f, 0.0f, 0.0f, 1.0f);
+    QMatrix4x4 homography(H[0][0], H[0][1], 0.0f, H[0][2],
+                          H[1][0], H[1][1], 0.0f, H[1][2],
+                          0.0f,    0.0f,    1.0f, 0.0f,
+                          H[2][0], H[2][1], 0.0f, H[2][2]);
+    M = homography * plane;
 
-    QVector3D X = q1.rotatedVector(u);
-    X.normalize();
+    return true;
+}
 
-    QVector3D Y = q2.rotatedVector(u);
-    Y.normalize();
+bool getHomographyParameters(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, double x[8])
+{
+    double o[3], u[3], v[3], n[3], H[3][3];
+    if(!fitHomography(points, markers, o, u, v, n, H))
+        return false;
 
-    // get translation estimate in Leap coordinate space
-    translation = (p1 - X * m1.x() / scale - Y * m1.y() / scale);
+    // derivative of the homography at the plane origin, its rows point along the screen axes
+    double J[2][2];
+    for(int j = 0; j < 2; j++)
+        for(int k = 0; k < 2; k++)
+            J[j][k] = H[j][k] - H[j][2] * H[2][k];
 
-    // ROTATION ESTIMATE
-    QVector3D Z = QVector3D::crossProduct(X,Y).normalized();
+    double R[3][3];
+    for(int k = 0; k < 3; k++){
+        R[0][k] = J[0][0] * u[k] + J[0][1] * v[k];
+        R[1][k] = J[1][0] * u[k] + J[1][1] * v[k];
+    }
 
-    float ry = asin(-QVector3D::dotProduct(X, z));
-    float rx = atan2(QVector3D::dotProduct(Y, z) / cos(ry), QVector3D::dotProduct(Z, z) / cos(ry));
-    float rz = atan2(QVector3D::dotProduct(X, y) / cos(ry), QVector3D::dotProduct(X, x) / cos(ry));
+    // the nearest rotation, Gram-Schmidt from the x axis
+    double l0 = sqrt(R[0][0]*R[0][0] + R[0][1]*R[0][1] + R[0][2]*R[0][2]);
+    if(l0 <= 0.0)
+        return false;
+    for(int k = 0; k < 3; k++)
+        R[0][k] /= l0;
+    double d = R[0][0]*R[1][0] + R[0][1]*R[1][1] + R[0][2]*R[1][2];
+    for(int k = 0; k < 3; k++)
+        R[1][k] -= d * R[0][k];
+    double l1 = sqrt(R[1][0]*R[1][0] + R[1][1]*R[1][1] + R[1][2]*R[1][2]);
+    if(l1 <= 0.0)
+        return false;
+    for(int k = 0; k < 3; k++)
+        R[1][k] /= l1;
+    R[2][0] = R[0][1]*R[1][2] - R[0][2]*R[1][1];
+    R[2][1] = R[0][2]*R[1][0] - R[0][0]*R[1][2];
+    R[2][2] = R[0][0]*R[1][1] - R[0][1]*R[1][0];
+
+    double angles[3], s[2], t[3];
+    scaleAndTranslation(points, markers, R, s, t);
+    eulerAngles(R, angles);
+
+    for(int k = 0; k < 3; k++){
+        x[k] = angles[k];
+        x[3 + k] = t[k];
+    }
+    x[6] = s[0]; x[7] = s[1];
 
-    rotation = QVector3D(rx, ry, rz);
+    return true;
 }
 
-int errorFunc(int m, int /*n*/, double *p, double *deviates, double **/*derivs*/, void *vars)
+// error of a tap that no spread accounts for, the finger is never placed exactly on the marker (Leap units)
+static const double TAP_ERROR_FLOOR = 1.0;
+
+ErrorFuncPointData::ErrorFuncPointData(const QVector<QVector4D> &points, const QVector<QVector4D> &markers, const QVector<double> &spreads)
 {
-    QMatrix4x4 M = createTransformationMatrix(p[0], p[1], p[2], QVector3D(p[3], p[4], p[5]), QVector3D(p[6], p[7], 1.0f));
+    int n = qMin(points.size(), markers.size());
+    px.resize(n); py.resize(n); pz.resize(n);
+    mx.resize(n); my.resize(n); mz.resize(n);
+
+    for(int i = 0; i < n; i++){
+        px[i] = points[i].x(); py[i] = points[i].y(); pz[i] = points[i].z();
+        mx[i] = markers[i].x(); my[i] = markers[i].y(); mz[i] = markers[i].z();
+    }
 
-    QVector4D point = M.inverted() * QVector4D(0,0,0,1);
-    QVector4D normal = M.inverted() * QVector4D(0,0,1,0);
-    Plane P(point, normal);
+    if(spreads.size() < n || n == 0)
+        return;
 
-    ErrorFuncPointData * v = (ErrorFuncPointData *) vars;
+    w.resize(n);
+    double sum2 = 0.0;
+    for(int i = 0; i < n; i++){
+        w[i] = 1.0 / std::sqrt(TAP_ERROR_FLOOR * TAP_ERROR_FLOOR + spreads[i] * spreads[i]);
+        sum2 += w[i] * w[i];
+    }
+
+    double scale = std::sqrt(n / sum2);
+    for(int i = 0; i < n; i++)
+        w[i] *= scale;
+}
+
+int ErrorFuncPointData::size() const
+{
+    return px.size();
+}
 
-    for(int i = 0, j = 0; i < m; i++, j++){
-        Ray R(v->points[j], -normal);
+double ErrorFuncPointData::weight(int i) const
+{
+    return w.isEmpty() ? 1.0 : w[i];
+}
 
-        QVector4D I(0,0,0,1);
-        if(P.intersect(R, I)){ // it will always intersect the plane
-            I = M * I;
-            I.setZ(P.pointDist(v->points[j].toVector3D()));
+// d[i] = a . point[i] + c - offset[i] for all points, offset may be NULL.
+// Plain loops over contiguous arrays with the coefficients in locals, so the compiler can vectorize them.
+static void affineKernel(int n, const double * px, const double * py, const double * pz, const double a[3], double c, const double * offset, double * d)
+{
+    const double a0 = a[0], a1 = a[1], a2 = a[2];
+
+    if(offset){
+        for(int i = 0; i < n; i++)
+            d[i] = a0*px[i] + a1*py[i] + a2*pz[i] + c - offset[i];
+    }else{
+        for(int i = 0; i < n; i++)
+            d[i] = a0*px[i] + a1*py[i] + a2*pz[i] + c;
+    }
+}
 
-            QVector4D pt = (I - v->markers[j]);
+int errorFunc(int m, int /*n*/, double *p, double *deviates, double **derivs, void *vars)
+{
+    // the residual equals S * R * (point - t) - marker, S = diag(sx, sy, 1), see createTransformationMatrix.
+    // It is stored per coordinate, first x of all points, then y, then z.
+    ErrorFuncPointData * v = (ErrorFuncPointData *) vars;
+    const int n = m / 3;
+    const double * px = v->px.constData();
+    const double * py = v->py.constData();
+    const double * pz = v->pz.constData();
+    const double * marker[3] = {v->mx.constData(), v->my.constData(), v->mz.constData()};
+
+    double R[3][3], dR[3][3][3];
+    rotationMatrix(p[0], p[1], p[2], R, dR);
+    double s[3] = {p[6], p[7], 1.0};
+
+    for(int k = 0; k < 3; k++){
+        // row k of S * R with the translation folded into the constant
+        double a[3] = {s[k]*R[k][0], s[k]*R[k][1], s[k]*R[k][2]};
+        affineKernel(n, px, py, pz, a, -(a[0]*p[3] + a[1]*p[4] + a[2]*p[5]), marker[k], deviates + k*n);
+
+        if(!derivs)
+            continue;
+
+        for(int l = 0; l < 3; l++){
+            if(derivs[l]){
+                double b[3] = {s[k]*dR[l][k][0], s[k]*dR[l][k][1], s[k]*dR[l][k][2]};
+                affineKernel(n, px, py, pz, b, -(b[0]*p[3] + b[1]*p[4] + b[2]*p[5]), NULL, derivs[l] + k*n);
+            }
+            if(derivs[l + 3])
+                std::fill(derivs[l + 3] + k*n, derivs[l + 3] + (k + 1)*n, -s[k] * R[k][l]);
+        }
 
-            deviates[i]   = pt.x();
-            deviates[++i] = pt.y();
-            deviates[++i] = pt.z();
-        }else{ // this will never happen
-            deviates[i]   = 1000;
-            deviates[++i] = 1000;
-            deviates[++i] = 1000;
+        for(int l = 0; l < 2; l++){
+            if(!derivs[l + 6])
+                continue;
+            if(k == l)
+                affineKernel(n, px, py, pz, R[k], -(R[k][0]*p[3] + R[k][1]*p[4] + R[k][2]*p[5]), NULL, derivs[l + 6] + k*n);
+            else
+                std::fill(derivs[l + 6] + k*n, derivs[l + 6] + (k + 1)*n, 0.0);
         }
     }
+
+    if(v->w.isEmpty())
+        return 0;
+
+    // weighted pairs, every residual and its derivatives scaled by the weight of the pair
+    const double * w = v->w.constData();
+    for(int k = 0; k < 3; k++){
+        for(int i = 0; i < n; i++)
+            deviates[k*n + i] *= w[i];
+        for(int l = 0; derivs && l < 8; l++)
+            if(derivs[l])
+                for(int i = 0; i < n; i++)
+                    derivs[l][k*n + i] *= w[i];
+    }
     return 0;
 }
 
-QMatrix4x4 computeTransformationMatrixFromPoints(const QVector<QVector4D> & points, const QVector<QVector4D> & markers)
+// Scales the three residuals of a weighted pair and, if J is not null, their derivatives
+template<int N>
+static void weigh(double w, double * r, double (*J)[N])
 {
-    QMatrix4x4 M;
+    for(int k = 0; k < 3; k++){
+        r[k] *= w;
+        if(J)
+            for(int l = 0; l < N; l++)
+                J[k][l] *= w;
+    }
+}
 
-    //initial estimates
-    // x[] = {rotX, rotY, rotZ, tX, tY, tZ, scale}
-    float scaleEst;
-    QVector3D translationEst, rotationEst;
-    getInitialEstimates(points, markers, rotationEst, translationEst, scaleEst);
-    double x[] = {rotationEst.x(), rotationEst.y(), rotationEst.z(), translationEst.x(), translationEst.y(), translationEst.z(), scaleEst,  scaleEst};
-    //double x[] = {0, 0, 0, 0, 0, 0, 1,  1};
+// Screen transformation residuals S * R * (point - t) - marker for LMSolver, the same model as errorFunc
+struct TransformationResidual
+{
+    enum { PARAMETERS = 8, RESIDUALS = 3 };
 
-    qDebug() << "DEBUG: INITIAL ESTIMATES";
-    qDebug() << "========================";
-    qDebug() << "DEBUG: Rotation\t\t" << rotationEst * 180.0f / M_PI;
-    qDebug() << "DEBUG: Translation\t\t" << translationEst;
-    qDebug() << "DEBUG: Scale\t\t" << scaleEst;
-    qDebug() << "";
+    TransformationResidual(const ErrorFuncPointData & data)
+        :data(data)
+    {
+    }
+
+    int size() const
+    {
+        return data.size();
+    }
+
+    void prepare(const double * p)
+    {
+        rotationMatrix(p[0], p[1], p[2], R, dR);
+        for(int k = 0; k < 3; k++)
+            t[k] = p[3 + k];
+        s[0] = p[6];
+        s[1] = p[7];
+        s[2] = 1.0;
+    }
+
+    void evaluate(int i, double * r, double (*J)[PARAMETERS]) const
+    {
+        double q[3] = {data.px[i] - t[0], data.py[i] - t[1], data.pz[i] - t[2]};
+        double marker[3] = {data.mx[i], data.my[i], data.mz[i]};
+
+        for(int k = 0; k < 3; k++){
+            double Rq = R[k][0]*q[0] + R[k][1]*q[1] + R[k][2]*q[2];
+            r[k] = s[k] * Rq - marker[k];
+
+            if(J){
+                for(int l = 0; l < 3; l++){
+                    J[k][l]     = s[k] * (dR[l][k][0]*q[0] + dR[l][k][1]*q[1] + dR[l][k][2]*q[2]);
+                    J[k][l + 3] = -s[k] * R[k][l];
+                }
+                J[k][6] = k == 0 ? Rq : 0.0;
+                J[k][7] = k == 1 ? Rq : 0.0;
+            }
+        }
+
+        if(!data.w.isEmpty())
+            weigh(data.w[i], r, J);
+    }
+
+    void update(const double * p, const double * delta, double * pnew) const
+    {
+        for(int k = 0; k < PARAMETERS; k++)
+            pnew[k] = p[k] + delta[k];
+    }
+
+    const ErrorFuncPointData & data;
+    double R[3][3], dR[3][3][3];
+    double t[3], s[3];
+};
+
+// The same residuals with the rotation given as rotation vector w, R = exp([w]x), instead of Euler angles.
+// The rotation derivatives are taken with respect to a small rotation applied on the left,
+// R <- exp([delta]x) * R, which update() composes onto the current rotation. Unlike the Euler
+// derivatives this local parameterization has no singular configurations.
+struct RotationVectorResidual
+{
+    enum { PARAMETERS = 8, RESIDUALS = 3 };
+
+    RotationVectorResidual(const ErrorFuncPointData & data)
+        :data(data)
+    {
+    }
+
+    int size() const
+    {
+        return data.size();
+    }
+
+    void prepare(const double * p)
+    {
+        rotationVectorToMatrix(p, R);
+        for(int k = 0; k < 3; k++)
+            t[k] = p[3 + k];
+        s[0] = p[6];
+        s[1] = p[7];
+        s[2] = 1.0;
+    }
+
+    void evaluate(int i, double * r, double (*J)[PARAMETERS]) const
+    {
+        double q[3] = {data.px[i] - t[0], data.py[i] - t[1], data.pz[i] - t[2]};
+        double marker[3] = {data.mx[i], data.my[i], data.mz[i]};
+
+        double v[3];
+        for(int k = 0; k < 3; k++){
+            v[k] = R[k][0]*q[0] + R[k][1]*q[1] + R[k][2]*q[2];
+            r[k] = s[k] * v[k] - marker[k];
+        }
+
+        if(J){
+            // d(exp([delta]x) * v) / d(delta) = -[v]x
+            double Vx[3][3] = {{0.0, v[2], -v[1]}, {-v[2], 0.0, v[0]}, {v[1], -v[0], 0.0}};
+            for(int k = 0; k < 3; k++){
+                for(int l = 0; l < 3; l++){
+                    J[k][l]     = s[k] * Vx[k][l];
+                    J[k][l + 3] = -s[k] * R[k][l];
+                }
+                J[k][6] = k == 0 ? v[0] : 0.0;
+                J[k][7] = k == 1 ? v[1] : 0.0;
+            }
+        }
+
+        if(!data.w.isEmpty())
+            weigh(data.w[i], r, J);
+    }
+
+    void update(const double * p, const double * delta, double * pnew) const
+    {
+        double D[3][3], P[3][3], Rnew[3][3];
+        rotationVectorToMatrix(delta, D);
+        rotationVectorToMatrix(p, P);
+        multiply(D, P, Rnew);
+        matrixToRotationVector(Rnew, pnew);
+
+        for(int k = 3; k < PARAMETERS; k++)
+            pnew[k] = p[k] + delta[k];
+    }
 
-    ErrorFuncPointData errFuncData = {points, markers};
+    const ErrorFuncPointData & data;
+    double R[3][3];
+    double t[3], s[3];
+};
 
-    mp_config config;
-    memset(&config, 0, sizeof(config));
-    config.maxfev = 100000;
-    config.maxiter = 100000;
+// errorFunc under an LMMonitor, the Jacobian is requested once per mpfit iteration, so that is where the monitor is asked
+struct MonitoredErrorFuncData
+{
+    const ErrorFuncPointData * data;
+    LMMonitor * monitor;
+    int iteration;
+};
+
+static int monitoredErrorFunc(int m, int n, double *p, double *deviates, double **derivs, void *vars)
+{
+    MonitoredErrorFuncData * v = (MonitoredErrorFuncData *) vars;
+    int status = errorFunc(m, n, p, deviates, derivs, (void *) v->data);
+    if(status || !derivs)
+        return status;
+
+    double chi2 = 0.0;
+    for(int i = 0; i < m; i++)
+        chi2 += deviates[i] * deviates[i];
 
-    mp_result result;
-    memset(&result, 0, sizeof(result));
+    // mpfit ends a solve on a negative status and keeps the parameters of the last accepted step
+    return v->monitor->iteration(++v->iteration, chi2) ? 0 : -1;
+}
 
-    mpfit(errorFunc, markers.size()*3, sizeof(x) / sizeof(x[0]), x, NULL, &config, &errFuncData, &result);
+// Refines the parameters x[] = {rotX, rotY, rotZ, tX, tY, tZ, scaleX, scaleY} in place, returns the final chi^2.
+// The counters of the solve are copied to result if not null, those of MPFIT as well.
+static double refineTransformation(const ErrorFuncPointData & errFuncData, double x[8], SolverType solver, mp_workspace * workspace, int maxIterations = 100000,
+                                   LMMonitor * monitor = NULL, LMResult * result = NULL)
+{
+    LMResult lmResult;
+    if(solver == MPFIT){
+        mp_config config;
+        memset(&config, 0, sizeof(config));
+        config.maxfev = 100000;
+        config.maxiter = maxIterations;
+
+        mp_result mpResult;
+        memset(&mpResult, 0, sizeof(mpResult));
+
+        // analytical derivatives
+        mp_par pars[8];
+        memset(pars, 0, sizeof(pars));
+        for(int i = 0; i < 8; i++)
+            pars[i].side = 3;
+
+        int status;
+        if(monitor){
+            MonitoredErrorFuncData data = {&errFuncData, monitor, 0};
+            status = mpfit_ws(monitoredErrorFunc, errFuncData.size()*3, 8, x, pars, &config, (void *) &data, &mpResult, workspace);
+        }else{
+            status = mpfit_ws(errorFunc, errFuncData.size()*3, 8, x, pars, &config, (void *) &errFuncData, &mpResult, workspace);
+        }
 
-    M = createTransformationMatrix(x[0], x[1], x[2], QVector3D(x[3], x[4], x[5]), QVector3D(x[6], x[7], 1.0f));
+        // a negative status is the monitor's stop
+        lmResult.bestnorm = mpResult.bestnorm;
+        lmResult.orignorm = mpResult.orignorm;
+        lmResult.niter = mpResult.niter;
+        lmResult.nfev = mpResult.nfev;
+        lmResult.status = status < 0 ? LM_STOPPED : status;
+        if(result)
+            *result = lmResult;
+        return lmResult.bestnorm;
+    }
+
+    if(solver == LEVMAR_ROTATION_VECTOR){
+        // solve for the rotation vector and convert back to the Euler angles of createTransformationMatrix
+        double R[3][3], dR[3][3][3], start[3] = {x[0], x[1], x[2]};
+        rotationMatrix(x[0], x[1], x[2], R, dR);
+        matrixToRotationVector(R, x);
+
+        RotationVectorResidual residual(errFuncData);
+
+        LMSolver<RotationVectorResidual> lm;
+        lm.maxIterations = maxIterations;
+        lm.monitor = monitor;
+        lm.solve(residual, x, &lmResult);
+
+        rotationVectorToMatrix(x, R);
+        eulerAngles(R, x);
+
+        // the angles come back in (-pi, pi], keep them on the turn of the start so that refits from the same
+        // solution (bootstrap, cross-validation) can be compared
+        for(int k = 0; k < 3; k++)
+            x[k] += 2.0 * M_PI * qRound((start[k] - x[k]) / (2.0 * M_PI));
+    }else{
+        TransformationResidual residual(errFuncData);
+
+        LMSolver<TransformationResidual> lm;
+        lm.maxIterations = maxIterations;
+        lm.monitor = monitor;
+        lm.solve(residual, x, &lmResult);
+    }
+    if(result)
+        *result = lmResult;
+    return lmResult.bestnorm;
+}
+
+static QMatrix4x4 transformationResult(const double x[8])
+{
+    QMatrix4x4 M = createTransformationMatrix(x[0], x[1], x[2], QVector3D(x[3], x[4], x[5]), QVector3D(x[6], x[7], 1.0f));
     //M = createTransformationMatrix(x[0], x[1], x[2], QVector3D(x[3], x[4], x[5]), QVector3D(x[6], x[6], 1.0f));
 
     qDebug() << "DEBUG: CALIBRATION RESULTS";
@@ -247,52 +981,1332 @@ QMatrix4x4 computeTransformationMatrixFromPoints(const QVector<QVector4D> & poin
     return M;
 }
 
-int errorFunc2(int m, int /*n*/, double *p, double *deviates, double **/*derivs*/, void *vars)
+QMatrix4x4 computeTransformationMatrixFromPoints(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, SolverType solver, mp_workspace * workspace, double * parameters,
+                                                 SolverControl * control, const QVector<double> & spreads)
 {
-    QVector3D c(p[0], p[1], p[2]);
-    QVector<Ray> * v = (QVector<Ray> *) vars;
+    QElapsedTimer timer;
+    timer.start();
+
+    //initial estimates
+    // x[] = {rotX, rotY, rotZ, tX, tY, tZ, scale}
+    QVector2D scaleEst;
+    QVector3D translationEst, rotationEst;
+    getInitialEstimates(points, markers, rotationEst, translationEst, scaleEst);
+    double x[] = {rotationEst.x(), rotationEst.y(), rotationEst.z(), translationEst.x(), translationEst.y(), translationEst.z(), scaleEst.x(),  scaleEst.y()};
+    //double x[] = {0, 0, 0, 0, 0, 0, 1,  1};
+    if(control)
+        control->record("initial estimate", timer);
+
+    qDebug() << "DEBUG: INITIAL ESTIMATES";
+    qDebug() << "========================";
+    qDebug() << "DEBUG: Rotation\t\t" << rotationEst * 180.0f / M_PI;
+    qDebug() << "DEBUG: Translation\t\t" << translationEst;
+    qDebug() << "DEBUG: Scale\t\t" << scaleEst;
+    qDebug() << "";
+
+    timer.start();
+    ErrorFuncPointData errFuncData(points, markers, spreads);
+    LMResult result;
+    refineTransformation(errFuncData, x, solver, workspace, 100000, control, &result);
+    if(control)
+        control->record("transformation fit", timer, &result);
+
+    if(parameters)
+        for(int i = 0; i < 8; i++)
+            parameters[i] = x[i];
+
+    return transformationResult(x);
+}
 
-    for(int i = 0, j = 0; i < m; i++, j++){
-        Ray r = (*v)[j];
-        QVector3D pt = (r.origin.toVector3D() - c) - (QVector3D::dotProduct((r.origin.toVector3D() - c), r.direction.toVector3D())) * r.direction.toVector3D();
-        deviates[i]   = pt.x();
-        deviates[++i] = pt.y();
-        deviates[++i] = pt.z();
+// One start of the multi-start search
+struct TransformationSeed
+{
+    double x[8];
+    double chi2;
+    bool solved;
+    LMResult result;
+};
+
+// Stops the refinement of a seed once the time budget of the search is used up or the calibration expires.
+// With progress set the iterations are also reported to control.
+class SeedMonitor: public LMMonitor
+{
+public:
+    SeedMonitor(const QElapsedTimer & timer, qint64 timeBudget, SolverControl * control, bool progress)
+        :timer(timer), timeBudget(timeBudget), control(control), progress(progress)
+    {
     }
-    return 0;
+
+    bool iteration(int iter, double chi2)
+    {
+        if(progress && control && !control->iteration(iter, chi2))
+            return false;
+        return timer.elapsed() <= timeBudget && !(control && control->expired());
+    }
+
+private:
+    const QElapsedTimer & timer;
+    qint64 timeBudget;
+    SolverControl * control;
+    bool progress;
+};
+
+// Refines one seed unless the time budget of the search is used up, called concurrently for different seeds
+class RefineSeed
+{
+public:
+    RefineSeed(const ErrorFuncPointData & data, SolverType solver, const QElapsedTimer & timer, qint64 timeBudget, SolverControl * control)
+        :data(data), solver(solver), timer(timer), timeBudget(timeBudget), control(control)
+    {
+    }
+
+    void operator()(TransformationSeed & seed) const
+    {
+        if(timer.elapsed() > timeBudget || (control && control->expired()))
+            return;
+
+        // a seed in a good basin converges in a few iterations, the cap stops those sliding down a degenerate valley,
+        // the monitor stops a seed that is still running when the budget runs out
+        SeedMonitor monitor(timer, timeBudget, control, false);
+        seed.chi2 = refineTransformation(data, seed.x, solver, NULL, 200, &monitor, &seed.result);
+        seed.solved = true;
+    }
+
+private:
+    const ErrorFuncPointData & data;
+    SolverType solver;
+    const QElapsedTimer & timer;
+    qint64 timeBudget;
+    SolverControl * control;
+};
+
+// uniformly distributed in [-1, 1], a small generator of our own so the seeds are reproducible
+static double uniformRandom(quint32 & state)
+{
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) / double(1 << 23) - 1.0;
+}
+
+QMatrix4x4 computeTransformationMatrixMultiStart(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int seeds, int timeBudget, SolverType solver, double * parameters,
+                                                 SolverControl * control, const QVector<double> & spreads)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QVector2D scaleEst;
+    QVector3D translationEst, rotationEst;
+    getInitialEstimates(points, markers, rotationEst, translationEst, scaleEst);
+
+    double R0[3][3], dR[3][3][3];
+    rotationMatrix(rotationEst.x(), rotationEst.y(), rotationEst.z(), R0, dR);
+
+    // the estimate and the estimate with the screen axes swapped, applied on the screen side of the rotation. The scales
+    // are solved with their signs, so flipping a screen axis, or both axes with the normal, gives one of these seeds
+    // again and the swap covers the turns by 90 degrees.
+    static const int TURNS = 2;
+    static const double turns[TURNS][3][3] = {
+        {{1, 0, 0}, {0, 1, 0}, {0, 0,  1}},
+        {{0, 1, 0}, {1, 0, 0}, {0, 0, -1}}
+    };
+
+    // the closed-form estimate, its swapped variant, then random tilts of up to 30 degrees
+    QVector<TransformationSeed> starts(qMax(seeds, 1));
+    quint32 state = 1;
+    for(int i = 0; i < starts.size(); i++){
+        double R[3][3];
+        if(i < TURNS){
+            multiply(turns[i], R0, R);
+        }else{
+            double w[3] = {0.52 * uniformRandom(state), 0.52 * uniformRandom(state), 0.52 * uniformRandom(state)};
+            double D[3][3];
+            rotationVectorToMatrix(w, D);
+            multiply(D, R0, R);
+        }
+
+        TransformationSeed & seed = starts[i];
+        double s[2], t[3];
+        scaleAndTranslation(points, markers, R, s, t);
+        eulerAngles(R, seed.x);
+        for(int k = 0; k < 3; k++)
+            seed.x[3 + k] = t[k];
+        seed.x[6] = s[0];
+        seed.x[7] = s[1];
+        seed.chi2 = 0.0;
+        seed.solved = false;
+    }
+    if(control)
+        control->record("initial estimate", timer);
+
+    ErrorFuncPointData errFuncData(points, markers, spreads);
+
+    // the closed-form seed is always refined, until it converges or the budget runs out, the others as long as the
+    // budget lasts
+    QElapsedTimer stageTimer;
+    stageTimer.start();
+    SeedMonitor monitor(timer, timeBudget, control, true);
+    starts[0].chi2 = refineTransformation(errFuncData, starts[0].x, solver, NULL, 100000, &monitor, &starts[0].result);
+    starts[0].solved = true;
+    if(control)
+        control->record("transformation fit", stageTimer, &starts[0].result);
+
+    stageTimer.start();
+    QtConcurrent::blockingMap(starts.begin() + 1, starts.end(), RefineSeed(errFuncData, solver, timer, timeBudget, control));
+
+    // the other seeds as one stage, their counters summed and the chi^2 of the best one
+    int best = 0, solved = 0;
+    LMResult seedResult;
+    memset(&seedResult, 0, sizeof(seedResult));
+    for(int i = 0; i < starts.size(); i++){
+        if(!starts[i].solved)
+            continue;
+        solved++;
+        if(starts[i].chi2 < starts[best].chi2)
+            best = i;
+        if(i > 0){
+            seedResult.niter += starts[i].result.niter;
+            seedResult.nfev += starts[i].result.nfev;
+        }
+    }
+    seedResult.orignorm = starts[0].chi2;
+    seedResult.bestnorm = starts[best].chi2;
+    seedResult.status = starts[best].result.status;
+    if(control)
+        control->record(QString("multi-start (%1 of %2 seeds, best %3)").arg(solved).arg(starts.size()).arg(best), stageTimer, &seedResult);
+
+    if(parameters)
+        for(int i = 0; i < 8; i++)
+            parameters[i] = starts[best].x[i];
+
+    return transformationResult(starts[best].x);
 }
 
-QVector4D computeProjectorPosition(const QVector<Ray> & rays)
+// Screen position errors (x and y of S * R * (point - t) - marker) of all pairs for the parameters x[], see errorFunc
+static void screenErrors(const ErrorFuncPointData & data, const double x[8], double * ex, double * ey)
 {
-    QVector<QVector4D> closestPoints;
-    for(int i = 0; i < rays.size(); i++){
-        for(int j = i+1; j < rays.size(); j++){
-            QVector4D point;
-            rays[i].closestPoint(rays[j], point);
-            closestPoints.append(point);
+    double R[3][3], dR[3][3][3];
+    rotationMatrix(x[0], x[1], x[2], R, dR);
+
+    double * e[2] = {ex, ey};
+    const double * marker[2] = {data.mx.constData(), data.my.constData()};
+    for(int k = 0; k < 2; k++){
+        double row[3] = {x[6 + k]*R[k][0], x[6 + k]*R[k][1], x[6 + k]*R[k][2]};
+        affineKernel(data.size(), data.px.constData(), data.py.constData(), data.pz.constData(), row, -(row[0]*x[3] + row[1]*x[4] + row[2]*x[5]), marker[k], e[k]);
+    }
+}
+
+void getInitialParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double x[8])
+{
+    QVector2D scale;
+    QVector3D translation, rotation;
+    getInitialEstimates(points, markers, rotation, translation, scale);
+
+    x[0] = rotation.x(); x[1] = rotation.y(); x[2] = rotation.z();
+    x[3] = translation.x(); x[4] = translation.y(); x[5] = translation.z();
+    x[6] = scale.x(); x[7] = scale.y();
+}
+
+double refineTransformationParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double x[8], int maxIterations, SolverControl * control,
+                                      const QVector<double> & spreads, SolverType solver)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    ErrorFuncPointData errFuncData(points, markers, spreads);
+    LMResult result;
+    refineTransformation(errFuncData, x, solver, NULL, maxIterations, control, &result);
+    if(control)
+        control->record("transformation fit", timer, &result);
+
+    int n = errFuncData.size();
+    if(n == 0)
+        return 0.0;
+
+    QVector<double> ex(n), ey(n);
+    screenErrors(errFuncData, x, ex.data(), ey.data());
+
+    double error2 = 0.0;
+    for(int i = 0; i < n; i++)
+        error2 += ex[i]*ex[i] + ey[i]*ey[i];
+    return std::sqrt(error2 / n);
+}
+
+// One RANSAC hypothesis, the transformation through a minimal sample of three point/marker pairs
+struct InlierHypothesis
+{
+    int sample[3];
+    double x[8];
+    int inliers;
+    double error;
+};
+
+// Fits the transformation of one hypothesis in closed form and counts the pairs within the threshold,
+// called concurrently for different hypotheses
+class ScoreHypothesis
+{
+public:
+    ScoreHypothesis(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const ErrorFuncPointData & data, double threshold,
+                    const SolverControl * control)
+        :points(points), markers(markers), data(data), threshold(threshold), control(control)
+    {
+    }
+
+    void operator()(InlierHypothesis & hypothesis) const
+    {
+        hypothesis.inliers = 0;
+        hypothesis.error = 0.0;
+
+        if(control && control->expired())
+            return;
+
+        // collinear markers leave the rotation about their line undetermined
+        QVector3D m0 = markers[hypothesis.sample[0]].toVector3D();
+        QVector3D a = markers[hypothesis.sample[1]].toVector3D() - m0;
+        QVector3D b = markers[hypothesis.sample[2]].toVector3D() - m0;
+        if(QVector3D::crossProduct(a, b).length() < 0.1 * a.length() * b.length())
+            return;
+
+        QVector<QVector4D> samplePoints, sampleMarkers;
+        for(int k = 0; k < 3; k++){
+            samplePoints << points[hypothesis.sample[k]];
+            sampleMarkers << markers[hypothesis.sample[k]];
+        }
+
+        getInitialParameters(samplePoints, sampleMarkers, hypothesis.x);
+
+        int n = data.size();
+        QVector<double> ex(n), ey(n);
+        screenErrors(data, hypothesis.x, ex.data(), ey.data());
+
+        double threshold2 = threshold * threshold;
+        for(int i = 0; i < n; i++){
+            double error2 = ex[i]*ex[i] + ey[i]*ey[i];
+            if(error2 <= threshold2){
+                hypothesis.inliers++;
+                hypothesis.error += error2;
+            }
+        }
+    }
+
+private:
+    const QVector<QVector4D> & points;
+    const QVector<QVector4D> & markers;
+    const ErrorFuncPointData & data;
+    double threshold;
+    const SolverControl * control;
+};
+
+// At most maxHypotheses samples of three pairs are scored, all triples if there are fewer. All pairs are inliers if
+// the control expires before the search and the refit are done.
+QVector<bool> findTransformationInliers(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double threshold, int maxHypotheses, SolverControl * control,
+                                        SolverType solver)
+{
+    int n = qMin(points.size(), markers.size());
+    QVector<bool> inliers(n, true);
+    if(n <= 3)
+        return inliers;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // every triple when there are few pairs, a reproducible random selection otherwise
+    QVector<InlierHypothesis> hypotheses;
+    InlierHypothesis hypothesis;
+    if(n * (n - 1) * (n - 2) / 6 <= maxHypotheses){
+        for(int i = 0; i < n; i++)
+            for(int j = i + 1; j < n; j++)
+                for(int k = j + 1; k < n; k++){
+                    hypothesis.sample[0] = i; hypothesis.sample[1] = j; hypothesis.sample[2] = k;
+                    hypotheses << hypothesis;
+                }
+    }else{
+        quint32 state = 1;
+        while(hypotheses.size() < maxHypotheses){
+            for(int k = 0; k < 3; k++)
+                hypothesis.sample[k] = qBound(0, int((uniformRandom(state) + 1.0) / 2.0 * n), n - 1);
+            if(hypothesis.sample[0] != hypothesis.sample[1] && hypothesis.sample[0] != hypothesis.sample[2] && hypothesis.sample[1] != hypothesis.sample[2])
+                hypotheses << hypothesis;
+        }
+    }
+
+    ErrorFuncPointData errFuncData(points, markers);
+    QtConcurrent::blockingMap(hypotheses, ScoreHypothesis(points, markers, errFuncData, threshold, control));
+
+    // labels from a partial search would reject taps on too little evidence, all are kept once the control expired
+    if(control && control->expired()){
+        control->record("inlier search", timer);
+        return inliers;
+    }
+
+    // the largest consensus set, the smaller error among equally large ones
+    int best = 0;
+    for(int i = 1; i < hypotheses.size(); i++){
+        if(hypotheses[i].inliers > hypotheses[best].inliers ||
+           (hypotheses[i].inliers == hypotheses[best].inliers && hypotheses[i].error < hypotheses[best].error))
+            best = i;
+    }
+    if(hypotheses[best].inliers < 3){
+        if(control)
+            control->record("inlier search", timer);
+        return inliers;
+    }
+
+    // the final labels come from a least-squares fit to the consensus set, so they do not depend on the sample
+    QVector<double> ex(n), ey(n);
+    screenErrors(errFuncData, hypotheses[best].x, ex.data(), ey.data());
+
+    QVector<QVector4D> consensusPoints, consensusMarkers;
+    for(int i = 0; i < n; i++){
+        if(ex[i]*ex[i] + ey[i]*ey[i] <= threshold * threshold){
+            consensusPoints << points[i];
+            consensusMarkers << markers[i];
+        }
+    }
+
+    double x[8];
+    getInitialParameters(consensusPoints, consensusMarkers, x);
+    LMResult result;
+    refineTransformation(ErrorFuncPointData(consensusPoints, consensusMarkers), x, solver, NULL, 100000, control, &result);
+    screenErrors(errFuncData, x, ex.data(), ey.data());
+
+    if(!control || !control->expired())
+        for(int i = 0; i < n; i++)
+            inliers[i] = ex[i]*ex[i] + ey[i]*ey[i] <= threshold * threshold;
+
+    // the scoring of the hypotheses and the refit to the consensus set, with the counters of the refit
+    if(control)
+        control->record("inlier search", timer, &result);
+
+    return inliers;
+}
+
+// Solves the 3x3 linear system A x = b by Cramer's rule
+static bool solve3(const double A[3][3], const double b[3], double x[3])
+{
+    double det = A[0][0] * (A[1][1]*A[2][2] - A[1][2]*A[2][1])
+               - A[0][1] * (A[1][0]*A[2][2] - A[1][2]*A[2][0])
+               + A[0][2] * (A[1][0]*A[2][1] - A[1][1]*A[2][0]);
+    if(fabs(det) < 1e-12)
+        return false;
+
+    for(int k = 0; k < 3; k++){
+        double C[3][3];
+        for(int i = 0; i < 3; i++)
+            for(int j = 0; j < 3; j++)
+                C[i][j] = j == k ? b[i] : A[i][j];
+        x[k] = (C[0][0] * (C[1][1]*C[2][2] - C[1][2]*C[2][1])
+              - C[0][1] * (C[1][0]*C[2][2] - C[1][2]*C[2][0])
+              + C[0][2] * (C[1][0]*C[2][1] - C[1][1]*C[2][0])) / det;
+    }
+    return true;
+}
+
+bool computeProjectorPosition(const QVector<Ray> & rays, QVector4D & position, int iterations)
+{
+    // The point closest to all rays in the least-squares sense solves the normal equations
+    // sum_i (I - u_i u_i^T) c = sum_i (I - u_i u_i^T) o_i, which are accumulated in one pass over the rays.
+    // Optional iteratively reweighted passes then downweight rays far from the current estimate.
+    double c[3] = {0.0, 0.0, 0.0};
+
+    for(int iteration = 0; iteration <= iterations; iteration++){
+        double A[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+        double b[3] = {0.0, 0.0, 0.0};
+
+        foreach(Ray ray, rays){
+            QVector3D u = ray.direction.toVector3D().normalized();
+            double o[3] = {ray.origin.x(), ray.origin.y(), ray.origin.z()};
+
+            double P[3][3];
+            for(int k = 0; k < 3; k++)
+                for(int l = 0; l < 3; l++)
+                    P[k][l] = (k == l ? 1.0 : 0.0) - u[k] * u[l];
+
+            double w = 1.0;
+            if(iteration > 0){
+                // L1 weights, distances below 1 mm are not trusted more than 1 mm
+                double d[3];
+                for(int k = 0; k < 3; k++)
+                    d[k] = P[k][0] * (c[0] - o[0]) + P[k][1] * (c[1] - o[1]) + P[k][2] * (c[2] - o[2]);
+                w = 1.0 / qMax(1.0, sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]));
+            }
+
+            for(int k = 0; k < 3; k++){
+                for(int l = 0; l < 3; l++){
+                    A[k][l] += w * P[k][l];
+                    b[k] += w * P[k][l] * o[l];
+                }
+            }
+        }
+
+        // all rays parallel, there is no single closest point. A reweighted pass that fails keeps the
+        // previous estimate.
+        if(!solve3(A, b, c)){
+            if(iteration == 0)
+                return false;
+            break;
+        }
+    }
+
+    position = QVector4D(c[0], c[1], c[2], 1);
+    return true;
+}
+
+
+// Residuals of a 3D calibration as one problem, p[] = {rotX, rotY, rotZ, tX, tY, tZ, scaleX, scaleY, vX, vY, vZ}.
+// A tap q = R * (point - t) is projected from the projector c = R * (v - t) onto the screen plane z = 0,
+// I = (c_z * q - q_z * c) / (c_z - q_z), which is where the paint query puts it, and compared to its marker,
+// r = S * I - marker. The first tap on every marker touches the screen and also contributes its distance q_z.
+// Each tap is one block of the normal equations, so the sparse Jacobian is never stored.
+struct ProjectiveResidual
+{
+    enum { PARAMETERS = 11, RESIDUALS = 3 };
+
+    ProjectiveResidual(const ErrorFuncPointData & data, int taps)
+        :data(data), taps(taps)
+    {
+    }
+
+    int size() const
+    {
+        return data.size();
+    }
+
+    void prepare(const double * p)
+    {
+        rotationMatrix(p[0], p[1], p[2], R, dR);
+        for(int k = 0; k < 3; k++)
+            t[k] = p[3 + k];
+        s[0] = p[6];
+        s[1] = p[7];
+
+        double v[3] = {p[8] - t[0], p[9] - t[1], p[10] - t[2]};
+        for(int k = 0; k < 3; k++){
+            c[k] = R[k][0]*v[0] + R[k][1]*v[1] + R[k][2]*v[2];
+            for(int l = 0; l < 3; l++)
+                dc[l][k] = dR[l][k][0]*v[0] + dR[l][k][1]*v[1] + dR[l][k][2]*v[2];
+        }
+    }
+
+    void evaluate(int i, double * r, double (*J)[PARAMETERS]) const
+    {
+        double u[3] = {data.px[i] - t[0], data.py[i] - t[1], data.pz[i] - t[2]};
+        double q[3], dq[3][3];
+        for(int k = 0; k < 3; k++){
+            q[k] = R[k][0]*u[0] + R[k][1]*u[1] + R[k][2]*u[2];
+            for(int l = 0; l < 3; l++)
+                dq[l][k] = dR[l][k][0]*u[0] + dR[l][k][1]*u[1] + dR[l][k][2]*u[2];
+        }
+
+        double D = c[2] - q[2];
+        double I[2] = {(c[2]*q[0] - c[0]*q[2]) / D, (c[2]*q[1] - c[1]*q[2]) / D};
+        double marker[2] = {data.mx[i], data.my[i]};
+        bool touch = i % taps == 0;
+
+        r[0] = s[0] * I[0] - marker[0];
+        r[1] = s[1] * I[1] - marker[1];
+        r[2] = touch ? q[2] : 0.0;
+
+        if(!J){
+            if(!data.w.isEmpty())
+                weigh(data.w[i], r, J);
+            return;
+        }
+
+        for(int k = 0; k < 2; k++){
+            // derivatives of I[k] with respect to q[k], q_z, c[k] and c_z
+            double dIdq = c[2] / D;
+            double dIdqz = (I[k] - c[k]) / D;
+            double dIdc = -q[2] / D;
+            double dIdcz = (q[k] - I[k]) / D;
+
+            for(int l = 0; l < 3; l++){
+                J[k][l] = s[k] * (dIdq*dq[l][k] + dIdqz*dq[l][2] + dIdc*dc[l][k] + dIdcz*dc[l][2]);
+                // q and c both move by -R with t, the projector only moves c by R
+                double dIdv = dIdc*R[k][l] + dIdcz*R[2][l];
+                J[k][l + 3] = -s[k] * (dIdq*R[k][l] + dIdqz*R[2][l] + dIdv);
+                J[k][l + 8] = s[k] * dIdv;
+            }
+            J[k][6] = k == 0 ? I[0] : 0.0;
+            J[k][7] = k == 1 ? I[1] : 0.0;
+        }
+
+        for(int l = 0; l < PARAMETERS; l++)
+            J[2][l] = 0.0;
+        if(touch){
+            for(int l = 0; l < 3; l++){
+                J[2][l] = dq[l][2];
+                J[2][l + 3] = -R[2][l];
+            }
+        }
+
+        if(!data.w.isEmpty())
+            weigh(data.w[i], r, J);
+    }
+
+    void update(const double * p, const double * delta, double * pnew) const
+    {
+        for(int k = 0; k < PARAMETERS; k++)
+            pnew[k] = p[k] + delta[k];
+    }
+
+    const ErrorFuncPointData & data;
+    int taps;
+    double R[3][3], dR[3][3][3];
+    double t[3], s[2], c[3], dc[3][3];
+};
+
+// Relative change of chi^2 and of the parameters that ends the joint fit. The taps are only known to a few mm, so
+// iterating down to rounding error adds evaluations without moving the paint positions by more than 0.001 px.
+static const double JOINT_FIT_TOLERANCE = 1e-4;
+
+// Refines p[] of ProjectiveResidual in place, data holds the marker of every tap
+static void refineProjective(const ErrorFuncPointData & data, int taps, double p[ProjectiveResidual::PARAMETERS], int maxIterations, LMResult * result,
+                             LMMonitor * monitor = NULL)
+{
+    ProjectiveResidual residual(data, taps);
+
+    LMSolver<ProjectiveResidual> lm;
+    lm.maxIterations = maxIterations;
+    lm.ftol = JOINT_FIT_TOLERANCE;
+    lm.xtol = JOINT_FIT_TOLERANCE;
+    lm.monitor = monitor;
+    lm.solve(residual, p, result);
+}
+
+double refineProjectiveParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, double x[8], QVector4D & projectorPosition, int maxIterations,
+                                  SolverControl * control, const QVector<double> & spreads)
+{
+    QVector<QVector4D> tapMarkers;
+    for(int i = 0; i < points.size(); i++)
+        tapMarkers << markers[i / taps];
+
+    QElapsedTimer timer;
+    timer.start();
+
+    ErrorFuncPointData errFuncData(points, tapMarkers, spreads);
+    ProjectiveResidual residual(errFuncData, taps);
+
+    double p[ProjectiveResidual::PARAMETERS];
+    for(int k = 0; k < 8; k++)
+        p[k] = x[k];
+    p[8] = projectorPosition.x();
+    p[9] = projectorPosition.y();
+    p[10] = projectorPosition.z();
+
+    LMResult result;
+    refineProjective(errFuncData, taps, p, maxIterations, &result, control);
+    if(control)
+        control->record("joint fit", timer, &result);
+
+    for(int k = 0; k < 8; k++)
+        x[k] = p[k];
+    projectorPosition = QVector4D(p[8], p[9], p[10], 1.0);
+
+    // unweighted screen error only, the distances of the touching taps are in Leap units
+    double r[3], error2 = 0.0;
+    residual.prepare(p);
+    for(int i = 0; i < residual.size(); i++){
+        residual.evaluate(i, r, NULL);
+        error2 += (r[0]*r[0] + r[1]*r[1]) / (errFuncData.weight(i) * errFuncData.weight(i));
+    }
+
+    return residual.size() > 0 ? std::sqrt(error2 / residual.size()) : 0.0;
+}
+
+// weight of the smoothness terms relative to a pair, one per pair of neighbouring nodes
+static const double CORRECTION_SMOOTHING = 0.5;
+
+// Bilinear interpolation weights of a screen position, for the nodes i, i + 1, i + size and i + size + 1
+static void correctionWeights(const CorrectionGrid & grid, float x, float y, int & i, float w[4])
+{
+    // positions outside the grid take the offsets of its border
+    float fx = qBound(0.0f, (x - grid.x0) / (grid.x1 - grid.x0), 1.0f) * (grid.size - 1);
+    float fy = qBound(0.0f, (y - grid.y0) / (grid.y1 - grid.y0), 1.0f) * (grid.size - 1);
+    int cx = qMin(int(fx), grid.size - 2), cy = qMin(int(fy), grid.size - 2);
+    float tx = fx - cx, ty = fy - cy;
+
+    i = cy * grid.size + cx;
+    w[0] = (1.0f - tx) * (1.0f - ty);
+    w[1] = tx * (1.0f - ty);
+    w[2] = (1.0f - tx) * ty;
+    w[3] = tx * ty;
+}
+
+QVector2D CorrectionGrid::correct(const QVector2D & position) const
+{
+    if(isEmpty())
+        return position;
+
+    int i;
+    float w[4];
+    correctionWeights(*this, position.x(), position.y(), i, w);
+
+    const float * o = offsets.constData() + 2 * i;
+    const float * p = o + 2 * size;
+    return QVector2D(position.x() + w[0]*o[0] + w[1]*o[2] + w[2]*p[0] + w[3]*p[2],
+                     position.y() + w[0]*o[1] + w[1]*o[3] + w[2]*p[1] + w[3]*p[3]);
+}
+
+// Solves A X = B for a symmetric positive definite n x n A and m right-hand sides, both row-major and overwritten,
+// X replaces B
+static bool choleskySolve(int n, double * A, double * B, int m)
+{
+    for(int j = 0; j < n; j++){
+        double d = A[j*n+j];
+        for(int k = 0; k < j; k++)
+            d -= A[j*n+k] * A[j*n+k];
+        if(d <= 0.0)
+            return false;
+        A[j*n+j] = sqrt(d);
+
+        for(int i = j + 1; i < n; i++){
+            double s = A[i*n+j];
+            for(int k = 0; k < j; k++)
+                s -= A[i*n+k] * A[j*n+k];
+            A[i*n+j] = s / A[j*n+j];
+        }
+    }
+
+    for(int c = 0; c < m; c++){
+        for(int i = 0; i < n; i++){
+            double s = B[i*m+c];
+            for(int k = 0; k < i; k++)
+                s -= A[i*n+k] * B[k*m+c];
+            B[i*m+c] = s / A[i*n+i];
+        }
+        for(int i = n - 1; i >= 0; i--){
+            double s = B[i*m+c];
+            for(int k = i + 1; k < n; k++)
+                s -= A[k*n+i] * B[k*m+c];
+            B[i*m+c] = s / A[i*n+i];
+        }
+    }
+    return true;
+}
+
+// Normal matrix of the least squares of the offsets of grid against n residuals at positions, with the smoothing terms
+static void correctionNormalMatrix(const CorrectionGrid & grid, const QVector<QVector2D> & positions, int n, QVector<double> & A)
+{
+    int size = grid.size, nodes = size * size;
+    A.fill(0.0, nodes * nodes);
+    for(int i = 0; i < n; i++){
+        int first;
+        float w[4];
+        correctionWeights(grid, positions[i].x(), positions[i].y(), first, w);
+        int node[4] = {first, first + 1, first + size, first + size + 1};
+
+        for(int a = 0; a < 4; a++)
+            for(int b = 0; b < 4; b++)
+                A[node[a]*nodes + node[b]] += w[a] * w[b];
+    }
+
+    // first differences of neighbouring nodes, and a slight pull towards no correction so the system stays definite
+    for(int j = 0; j < size; j++){
+        for(int i = 0; i < size; i++){
+            int p = j * size + i;
+            A[p*nodes + p] += 1e-6;
+
+            int neighbours[2] = {i + 1 < size ? p + 1 : -1, j + 1 < size ? p + size : -1};
+            for(int k = 0; k < 2; k++){
+                int q = neighbours[k];
+                if(q < 0)
+                    continue;
+                A[p*nodes + p] += CORRECTION_SMOOTHING;
+                A[q*nodes + q] += CORRECTION_SMOOTHING;
+                A[p*nodes + q] -= CORRECTION_SMOOTHING;
+                A[q*nodes + p] -= CORRECTION_SMOOTHING;
+            }
+        }
+    }
+}
+
+CorrectionGrid fitCorrectionGrid(const QVector<QVector2D> & positions, const QVector<QVector2D> & residuals, int size)
+{
+    CorrectionGrid grid;
+    int n = qMin(positions.size(), residuals.size());
+    if(size < 2 || n < 4)
+        return grid;
+
+    grid.size = size;
+    grid.x0 = grid.x1 = positions[0].x();
+    grid.y0 = grid.y1 = positions[0].y();
+    for(int i = 1; i < n; i++){
+        grid.x0 = qMin(grid.x0, positions[i].x()); grid.x1 = qMax(grid.x1, positions[i].x());
+        grid.y0 = qMin(grid.y0, positions[i].y()); grid.y1 = qMax(grid.y1, positions[i].y());
+    }
+    if(grid.x1 - grid.x0 < 1.0f || grid.y1 - grid.y0 < 1.0f)
+        return CorrectionGrid();
+
+    // least squares of the interpolated offsets against the residuals, both axes share the normal matrix
+    int nodes = size * size;
+    QVector<double> A, B(nodes * 2, 0.0);
+    correctionNormalMatrix(grid, positions, n, A);
+    for(int i = 0; i < n; i++){
+        int first;
+        float w[4];
+        correctionWeights(grid, positions[i].x(), positions[i].y(), first, w);
+        int node[4] = {first, first + 1, first + size, first + size + 1};
+
+        for(int a = 0; a < 4; a++){
+            B[node[a]*2] += w[a] * residuals[i].x();
+            B[node[a]*2 + 1] += w[a] * residuals[i].y();
+        }
+    }
+
+    if(!choleskySolve(nodes, A.data(), B.data(), 2))
+        return CorrectionGrid();
+
+    grid.offsets.resize(nodes * 2);
+    for(int i = 0; i < nodes * 2; i++)
+        grid.offsets[i] = B[i];
+
+    return grid;
+}
+
+// Variance the correction grid fitted to the residuals at positions adds to the corrected position at every query,
+// summed over both axes. The offsets are linear in the residuals, o = A^-1 W^T r, so for independent residuals of
+// variance s^2 on each axis var(w^T o) = s^2 |W A^-1 w|^2, with s^2 estimated from what the grid leaves of them.
+// Empty if there is no grid.
+static QVector<double> correctionVariance(const QVector<QVector2D> & positions, const QVector<QVector2D> & residuals, int size, const QVector<QVector2D> & queries)
+{
+    QVector<double> variance;
+    CorrectionGrid grid = fitCorrectionGrid(positions, residuals, size);
+    if(grid.isEmpty())
+        return variance;
+
+    int n = qMin(positions.size(), residuals.size()), q = queries.size(), m = q + n, nodes = size * size;
+    QVector<double> A;
+    correctionNormalMatrix(grid, positions, n, A);
+
+    // one right-hand side for the weights of every query and of every position, the latter for the trace of the
+    // hat matrix W A^-1 W^T, the degrees of freedom taken by the grid
+    QVector<int> first(m);
+    QVector<float> w(4 * m);
+    QVector<double> B(nodes * m, 0.0);
+    for(int c = 0; c < m; c++){
+        QVector2D position = c < q ? queries[c] : positions[c - q];
+        correctionWeights(grid, position.x(), position.y(), first[c], &w[4 * c]);
+        int node[4] = {first[c], first[c] + 1, first[c] + size, first[c] + size + 1};
+        for(int a = 0; a < 4; a++)
+            B[node[a]*m + c] += w[4*c + a];
+    }
+    if(!choleskySolve(nodes, A.data(), B.data(), m))
+        return variance;
+
+    // (W A^-1 w_c)_i for the column c of B
+    QVector<double> WZ(n * m);
+    for(int i = 0; i < n; i++){
+        const float * wi = &w[4 * (q + i)];
+        int node[4] = {first[q + i], first[q + i] + 1, first[q + i] + size, first[q + i] + size + 1};
+        for(int c = 0; c < m; c++)
+            WZ[i*m + c] = wi[0]*B[node[0]*m + c] + wi[1]*B[node[1]*m + c] + wi[2]*B[node[2]*m + c] + wi[3]*B[node[3]*m + c];
+    }
+
+    double rss = 0.0, trace = 0.0;
+    for(int i = 0; i < n; i++){
+        rss += (positions[i] + residuals[i] - grid.correct(positions[i])).lengthSquared();
+        trace += WZ[i*m + q + i];
+    }
+    double s2 = rss / (2.0 * qMax(n - trace, 1.0));
+
+    for(int c = 0; c < q; c++){
+        double v = 0.0;
+        for(int i = 0; i < n; i++)
+            v += WZ[i*m + c] * WZ[i*m + c];
+        variance << 2.0 * s2 * v;
+    }
+    return variance;
+}
+
+// Sum of squared residuals of f at p
+template<class F>
+static double residualNorm(F & f, const double * p)
+{
+    double r[F::RESIDUALS], chi2 = 0.0;
+    f.prepare(p);
+    for(int i = 0; i < f.size(); i++){
+        f.evaluate(i, r, NULL);
+        for(int k = 0; k < F::RESIDUALS; k++)
+            chi2 += r[k] * r[k];
+    }
+    return chi2;
+}
+
+// Covariance of the parameters p at the solution, chi^2 / (m - n) * (J^T J)^-1 for m residuals
+template<class F>
+static bool solutionCovariance(F & f, const double * p, int m, double C[F::PARAMETERS][F::PARAMETERS])
+{
+    int n = F::PARAMETERS;
+    if(m <= n)
+        return false;
+
+    LMSolver<F> lm;
+    if(!lm.covariance(f, p, C))
+        return false;
+
+    double sigma2 = residualNorm(f, p) / (m - n);
+    for(int k = 0; k < n; k++)
+        for(int l = 0; l < n; l++)
+            C[k][l] *= sigma2;
+    return true;
+}
+
+// Whether the markers span a plane, fewer than three distinct or collinear markers leave the rotation about their line undetermined
+static bool spansPlane(const QVector<QVector4D> & markers)
+{
+    if(markers.isEmpty())
+        return false;
+
+    QVector3D m0 = markers[0].toVector3D(), a;
+    foreach(QVector4D marker, markers)
+        if((marker.toVector3D() - m0).length() > a.length())
+            a = marker.toVector3D() - m0;
+
+    foreach(QVector4D marker, markers){
+        QVector3D b = marker.toVector3D() - m0;
+        if(QVector3D::crossProduct(a, b).length() >= 0.1 * a.length() * b.length() && b.length() > 0.0f)
+            return true;
+    }
+    return false;
+}
+
+// Stops a refit once the control expired, without reporting progress, the refits of the bootstrap and the
+// cross-validation would otherwise run to their iteration limit after the deadline
+class ExpiryMonitor: public LMMonitor
+{
+public:
+    ExpiryMonitor(const SolverControl * control)
+        :control(control)
+    {
+    }
+
+    bool iteration(int /*iter*/, double /*chi2*/)
+    {
+        return !(control && control->expired());
+    }
+
+private:
+    const SolverControl * control;
+};
+
+// One bootstrap replicate, the calibration refitted to markers drawn with replacement
+struct BootstrapSample
+{
+    quint32 state;
+    double p[ProjectiveResidual::PARAMETERS];
+    bool solved;
+};
+
+// Draws the markers of one replicate, each with all its taps, and refits starting from the original solution,
+// called concurrently for different replicates. A draw that does not span a plane is left unsolved.
+class RefitBootstrapSample
+{
+public:
+    RefitBootstrapSample(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads, int taps, bool projective,
+                         SolverType solver, const SolverControl * control)
+        :points(points), markers(markers), spreads(spreads), taps(taps), projective(projective), solver(solver), control(control)
+    {
+    }
+
+    void operator()(BootstrapSample & sample) const
+    {
+        if(control && control->expired())
+            return;
+
+        int n = markers.size();
+        QVector<QVector4D> samplePoints, sampleMarkers, drawn;
+        QVector<double> sampleSpreads;
+        for(int i = 0; i < n; i++){
+            int k = qBound(0, int((uniformRandom(sample.state) + 1.0) / 2.0 * n), n - 1);
+            for(int j = 0; j < taps; j++){
+                samplePoints << points[k * taps + j];
+                sampleMarkers << markers[k];
+                if(!spreads.isEmpty())
+                    sampleSpreads << spreads[k * taps + j];
+            }
+            drawn << markers[k];
+        }
+        if(!spansPlane(drawn))
+            return;
+
+        // a replicate stopped by the deadline is not used
+        ErrorFuncPointData data(samplePoints, sampleMarkers, sampleSpreads);
+        ExpiryMonitor monitor(control);
+        if(projective)
+            refineProjective(data, taps, sample.p, 100, NULL, &monitor);
+        else
+            refineTransformation(data, sample.p, solver, NULL, 100, &monitor);
+        sample.solved = !(control && control->expired());
+    }
+
+private:
+    const QVector<QVector4D> & points;
+    const QVector<QVector4D> & markers;
+    const QVector<double> & spreads;
+    int taps;
+    bool projective;
+    SolverType solver;
+    const SolverControl * control;
+};
+
+// Sample covariance of the first n parameters over bootstrap replicates of the solution p, the transformation is refitted
+// with solver. Returns the number of replicates refitted before the control expired.
+static int bootstrapCovariance(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads, int taps, const double * p, int n,
+                               int samples, double * C, SolverType solver, const SolverControl * control)
+{
+    QVector<BootstrapSample> replicates(samples);
+    for(int i = 0; i < samples; i++){
+        replicates[i].state = i + 1;
+        replicates[i].solved = false;
+        for(int k = 0; k < n; k++)
+            replicates[i].p[k] = p[k];
+    }
+
+    QtConcurrent::blockingMap(replicates, RefitBootstrapSample(points, markers, spreads, taps, n == ProjectiveResidual::PARAMETERS, solver, control));
+
+    QVector<BootstrapSample> solved;
+    foreach(BootstrapSample replicate, replicates)
+        if(replicate.solved)
+            solved << replicate;
+    replicates = solved;
+    samples = replicates.size();
+    if(samples < 2)
+        return samples;
+
+    double mean[ProjectiveResidual::PARAMETERS];
+    for(int k = 0; k < n; k++){
+        mean[k] = 0.0;
+        for(int i = 0; i < samples; i++)
+            mean[k] += replicates[i].p[k] / samples;
+    }
+
+    for(int k = 0; k < n; k++){
+        for(int l = 0; l < n; l++){
+            double c = 0.0;
+            for(int i = 0; i < samples; i++)
+                c += (replicates[i].p[k] - mean[k]) * (replicates[i].p[l] - mean[l]);
+            C[k * n + l] = c / (samples - 1);
+        }
+    }
+    return samples;
+}
+
+// Screen positions of the taps in data under the n parameters p before the correction, the touch positions of a
+// transformation and the paint positions of a projective calibration, data has to be unweighted
+static void screenPositions(const ErrorFuncPointData & data, int taps, const double * p, int n, QVector<QVector2D> & positions)
+{
+    positions.resize(data.size());
+    if(n == ProjectiveResidual::PARAMETERS){
+        ProjectiveResidual residual(data, taps);
+        residual.prepare(p);
+        for(int i = 0; i < data.size(); i++){
+            double r[3];
+            residual.evaluate(i, r, NULL);
+            positions[i] = QVector2D(data.mx[i] + r[0], data.my[i] + r[1]);
         }
+    }else{
+        QVector<double> ex(data.size()), ey(data.size());
+        screenErrors(data, p, ex.data(), ey.data());
+        for(int i = 0; i < data.size(); i++)
+            positions[i] = QVector2D(data.mx[i] + ex[i], data.my[i] + ey[i]);
+    }
+}
+
+// Positions and residuals marker - position of the touching taps, the ones the server fits the correction grid to
+static void correctionResiduals(const ErrorFuncPointData & data, int taps, const double * p, int n, QVector<QVector2D> & positions, QVector<QVector2D> & residuals)
+{
+    QVector<QVector2D> all;
+    screenPositions(data, taps, p, n, all);
+    for(int i = 0; i < all.size(); i += taps){
+        positions << all[i];
+        residuals << QVector2D(data.mx[i], data.my[i]) - all[i];
+    }
+}
+
+// Appends the screen error of every residual of f predicted by the covariance C of its parameters p,
+// first order propagation, var = J C J^T summed over the two screen coordinates
+template<class F>
+static void propagateCovariance(F f, const double * p, const double * C, QVector<QVector3D> & errorMap)
+{
+    const int n = F::PARAMETERS;
+    f.prepare(p);
+    for(int i = 0; i < f.size(); i++){
+        double r[F::RESIDUALS], J[F::RESIDUALS][F::PARAMETERS];
+        f.evaluate(i, r, J);
+
+        double variance = 0.0;
+        for(int k = 0; k < 2; k++)
+            for(int a = 0; a < n; a++)
+                for(int b = 0; b < n; b++)
+                    variance += J[k][a] * C[a * n + b] * J[k][b];
+
+        errorMap << QVector3D(f.data.mx[i], f.data.my[i], std::sqrt(qMax(variance, 0.0)));
     }
+}
 
-    QVector4D V;
-    foreach(QVector4D point, closestPoints)
-        V += point;
-    V /= closestPoints.size();
+// Standard deviations of the n parameters and the screen error predicted by C on a grid spanning the markers,
+// the touch positions for a transformation and the paint positions at the mean height of the hovering taps for a
+// projective calibration, whose error also depends on the projector. With a correction grid of the given size, the
+// variance of its offsets refitted to the residuals is added.
+static CalibrationUncertainty uncertaintyFromCovariance(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, const double * x, int n,
+                                                        const double * C, int bootstrapSamples, int correctionGridSize)
+{
+    CalibrationUncertainty uncertainty;
+    uncertainty.bootstrapSamples = bootstrapSamples;
+    for(int k = 0; k < n; k++)
+        uncertainty.parameters << std::sqrt(qMax(C[k * n + k], 0.0));
+
+    double x0 = markers[0].x(), x1 = x0, y0 = markers[0].y(), y1 = y0;
+    foreach(QVector4D marker, markers){
+        x0 = qMin(x0, double(marker.x())); x1 = qMax(x1, double(marker.x()));
+        y0 = qMin(y0, double(marker.y())); y1 = qMax(y1, double(marker.y()));
+    }
 
-    double x[] = {V.x(),V.y(),V.z()};
+    double R[3][3], dR[3][3][3];
+    rotationMatrix(x[0], x[1], x[2], R, dR);
+    bool projective = n == ProjectiveResidual::PARAMETERS;
+
+    // screen frame projector c = R * (v - t) and mean height of the hovering taps q_z = (R * (point - t))_z
+    double c[3] = {0.0, 0.0, 0.0}, height = 0.0;
+    if(projective){
+        int hovering = 0;
+        for(int i = 0; i < points.size(); i++){
+            if(i % taps == 0)
+                continue;
+            height += R[2][0] * (points[i].x() - x[3]) + R[2][1] * (points[i].y() - x[4]) + R[2][2] * (points[i].z() - x[5]);
+            hovering++;
+        }
+        height = hovering > 0 ? height / hovering : 0.0;
+        for(int k = 0; k < 3; k++)
+            c[k] = R[k][0] * (x[8] - x[3]) + R[k][1] * (x[9] - x[4]) + R[k][2] * (x[10] - x[5]);
+    }
 
-    mp_config config;
-    memset(&config, 0, sizeof(config));
-    config.maxfev = 10000;
-    config.maxiter = 10000;
+    // the Leap points mapped exactly onto the grid, q = I + height / c_z * (c - I) on the ray from the projector through
+    // the screen position I = S^-1 * marker, point = t + R^T * q
+    QVector<QVector4D> gridPoints, gridMarkers;
+    for(int j = 0; j < ERROR_MAP_SIZE; j++){
+        for(int i = 0; i < ERROR_MAP_SIZE; i++){
+            double m[2] = {x0 + (x1 - x0) * i / (ERROR_MAP_SIZE - 1), y0 + (y1 - y0) * j / (ERROR_MAP_SIZE - 1)};
+            double f = projective && c[2] != 0.0 ? height / c[2] : 0.0;
+            double q[3] = {m[0] / x[6] + f * (c[0] - m[0] / x[6]), m[1] / x[7] + f * (c[1] - m[1] / x[7]), f * c[2]};
+            double point[3];
+            for(int k = 0; k < 3; k++)
+                point[k] = x[3 + k] + R[0][k] * q[0] + R[1][k] * q[1] + R[2][k] * q[2];
+            gridPoints << QVector4D(point[0], point[1], point[2], 1.0);
+            gridMarkers << QVector4D(m[0], m[1], 0.0, 1.0);
+        }
+    }
 
-    mp_result result;
-    memset(&result, 0, sizeof(result));
+    ErrorFuncPointData grid(gridPoints, gridMarkers);
+    if(projective)
+        propagateCovariance(ProjectiveResidual(grid, 1), x, C, uncertainty.errorMap);
+    else
+        propagateCovariance(TransformationResidual(grid), x, C, uncertainty.errorMap);
+
+    if(correctionGridSize >= 2){
+        QVector<QVector4D> tapMarkers;
+        for(int i = 0; i < points.size(); i++)
+            tapMarkers << markers[i / taps];
+
+        QVector<QVector2D> positions, residuals, queries;
+        correctionResiduals(ErrorFuncPointData(points, tapMarkers), taps, x, n, positions, residuals);
+        foreach(QVector3D error, uncertainty.errorMap)
+            queries << error.toVector2D();
+
+        QVector<double> variance = correctionVariance(positions, residuals, correctionGridSize, queries);
+        for(int i = 0; i < variance.size(); i++){
+            QVector3D & error = uncertainty.errorMap[i];
+            error.setZ(std::sqrt(error.z() * error.z() + variance[i]));
+        }
+    }
 
-    mpfit(errorFunc2, rays.size()*3, sizeof(x) / sizeof(x[0]), x, NULL, &config, (void*) &rays, &result);
+    return uncertainty;
+}
 
-    return QVector4D(x[0], x[1], x[2], 1);
+CalibrationUncertainty computeTransformationUncertainty(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8], int bootstrapSamples,
+                                                        SolverControl * control, const QVector<double> & spreads, int correctionGridSize, SolverType solver)
+{
+    const int n = TransformationResidual::PARAMETERS;
+    double C[n][n];
+
+    // the covariance of the fit unless enough replicates were refitted in time
+    if(bootstrapSamples > 1)
+        bootstrapSamples = bootstrapCovariance(points, markers, spreads, 1, x, n, bootstrapSamples, &C[0][0], solver, control);
+    if(bootstrapSamples < 2){
+        ErrorFuncPointData data(points, markers, spreads);
+        TransformationResidual residual(data);
+        if(!solutionCovariance(residual, x, 3 * data.size(), C))
+            return CalibrationUncertainty();
+        bootstrapSamples = 0;
+    }
+
+    return uncertaintyFromCovariance(points, markers, 1, x, n, &C[0][0], bootstrapSamples, correctionGridSize);
 }
 
+CalibrationUncertainty computeProjectiveUncertainty(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, const double x[8], const QVector4D & projectorPosition,
+                                                    int bootstrapSamples, SolverControl * control, const QVector<double> & spreads, int correctionGridSize)
+{
+    const int n = ProjectiveResidual::PARAMETERS;
+    double p[n], C[n][n];
+    for(int k = 0; k < 8; k++)
+        p[k] = x[k];
+    p[8] = projectorPosition.x();
+    p[9] = projectorPosition.y();
+    p[10] = projectorPosition.z();
+
+    if(bootstrapSamples > 1)
+        bootstrapSamples = bootstrapCovariance(points, markers, spreads, taps, p, n, bootstrapSamples, &C[0][0], LEVMAR, control);
+    if(bootstrapSamples < 2){
+        QVector<QVector4D> tapMarkers;
+        for(int i = 0; i < points.size(); i++)
+            tapMarkers << markers[i / taps];
+
+        // every tap has two screen residuals, the touching ones also their distance to the screen
+        ErrorFuncPointData data(points, tapMarkers, spreads);
+        ProjectiveResidual residual(data, taps);
+        if(!solutionCovariance(residual, p, 2 * points.size() + markers.size(), C))
+            return CalibrationUncertainty();
+        bootstrapSamples = 0;
+    }
+
+    return uncertaintyFromCovariance(points, markers, taps, p, n, &C[0][0], bootstrapSamples, correctionGridSize);
+}
+
+// One fold of the leave-one-out cross-validation
+struct HeldOutMarker
+{
+    int marker;
+    double p[ProjectiveResidual::PARAMETERS];
+    double error;
+    bool degenerate;
+};
+
+// Refits without the taps of one marker, starting from the full solution, and measures the RMS screen error of the
+// held-out taps under the refit and the correction grid refitted to the other markers, called concurrently for
+// different markers. A fold whose remaining markers do not span a plane is not refitted.
+class RefitWithoutMarker
+{
+public:
+    RefitWithoutMarker(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads, int taps, int n,
+                       int correctionGridSize, SolverType solver, const SolverControl * control)
+        :points(points), markers(markers), spreads(spreads), taps(taps), n(n), correctionGridSize(correctionGridSize), solver(solver), control(control)
+    {
+    }
+
+    void operator()(HeldOutMarker & fold) const
+    {
+        fold.error = -1.0;
+        fold.degenerate = false;
+        if(control && control->expired())
+            return;
+
+        QVector<QVector4D> remaining = markers;
+        remaining.remove(fold.marker);
+        if(!spansPlane(remaining)){
+            fold.degenerate = true;
+            return;
+        }
+
+        // the refit is weighted like the fit, the held-out error is the plain screen error
+        QVector<QVector4D> trainPoints, trainMarkers, testPoints, testMarkers;
+        QVector<double> trainSpreads;
+        for(int i = 0; i < points.size(); i++){
+            if(i / taps == fold.marker){
+                testPoints << points[i];
+                testMarkers << markers[i / taps];
+            }else{
+                trainPoints << points[i];
+                trainMarkers << markers[i / taps];
+                if(!spreads.isEmpty())
+                    trainSpreads << spreads[i];
+            }
+        }
+
+        ErrorFuncPointData train(trainPoints, trainMarkers, trainSpreads), test(testPoints, testMarkers);
+        ExpiryMonitor monitor(control);
+        if(n == ProjectiveResidual::PARAMETERS)
+            refineProjective(train, taps, fold.p, 100, NULL, &monitor);
+        else
+            refineTransformation(train, fold.p, solver, NULL, 100, &monitor);
+
+        // a fold stopped by the deadline is left out
+        if(control && control->expired())
+            return;
+
+        CorrectionGrid grid;
+        if(correctionGridSize >= 2){
+            QVector<QVector2D> positions, residuals;
+            correctionResiduals(ErrorFuncPointData(trainPoints, trainMarkers), taps, fold.p, n, positions, residuals);
+            grid = fitCorrectionGrid(positions, residuals, correctionGridSize);
+        }
+
+        QVector<QVector2D> positions;
+        screenPositions(test, taps, fold.p, n, positions);
+        double error2 = 0.0;
+        for(int i = 0; i < test.size(); i++)
+            error2 += (grid.correct(positions[i]) - QVector2D(test.mx[i], test.my[i])).lengthSquared();
+        fold.error = std::sqrt(error2 / test.size());
+    }
+
+private:
+    const QVector<QVector4D> & points;
+    const QVector<QVector4D> & markers;
+    const QVector<double> & spreads;
+    int taps;
+    int n;
+    int correctionGridSize;
+    SolverType solver;
+    const SolverControl * control;
+};
+
+// Folds are skipped after the control expired or if the other markers do not span a plane, the latter are counted
+// in the log. With correctionGridSize >= 2 every fold refits the correction grid, the projective folds use the joint fit.
+static QVector<double> crossValidate(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads, int taps, const double * p, int n,
+                                     int correctionGridSize, SolverType solver, const SolverControl * control)
+{
+    // every fold has to keep three markers for a fit
+    if(markers.size() < 4)
+        return QVector<double>();
+
+    QVector<HeldOutMarker> folds(markers.size());
+    for(int i = 0; i < folds.size(); i++){
+        folds[i].marker = i;
+        for(int k = 0; k < n; k++)
+            folds[i].p[k] = p[k];
+    }
+
+    QtConcurrent::blockingMap(folds, RefitWithoutMarker(points, markers, spreads, taps, n, correctionGridSize, solver, control));
+
+    QVector<double> errors;
+    int degenerate = 0;
+    foreach(HeldOutMarker fold, folds){
+        errors << fold.error;
+        if(fold.degenerate)
+            degenerate++;
+    }
+
+    if(degenerate > 0)
+        qDebug() << "WARNING: Cross-validation skipped" << degenerate << "of" << folds.size() << "folds whose remaining markers do not span a plane";
+    return errors;
+}
+
+QVector<double> crossValidateTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8], SolverControl * control,
+                                            const QVector<double> & spreads, int correctionGridSize, SolverType solver)
+{
+    return crossValidate(points, markers, spreads, 1, x, TransformationResidual::PARAMETERS, correctionGridSize, solver, control);
+}
+
+QVector<double> crossValidateProjective(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, const double x[8], const QVector4D & projectorPosition,
+                                        SolverControl * control, const QVector<double> & spreads, int correctionGridSize)
+{
+    double p[ProjectiveResidual::PARAMETERS];
+    for(int k = 0; k < 8; k++)
+        p[k] = x[k];
+    p[8] = projectorPosition.x();
+    p[9] = projectorPosition.y();
+    p[10] = projectorPosition.z();
+
+    return crossValidate(points, markers, spreads, taps, p, ProjectiveResidual::PARAMETERS, correctionGridSize, LEVMAR, control);
+}
 
 Plane::Plane()
     :point(QVector4D(0.0, 0.0, 0.0, 1.0)), normal(QVector4D(0.0, 0.0, 1.0, 0.0))
@@ -6,13 +6,20 @@
 
 #include <QMatrix4x4>
 #include <QVector4D>
+#include <QVector2D>
 #include <QVector>
+#include <QObject>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
 
 //#include <cmath>
 //#include <math.h>
 
 
 #include "mpfit/mpfit.h"
+#include "lmsolver.h"
 
 class Ray
 {
@@ -26,6 +33,23 @@ public:
     QVector4D direction;
 };
 
+// Streaming least-squares line fit, points are added in O(1) and the line is extracted in closed form
+class RayAccumulator
+{
+public:
+    RayAccumulator();
+    void add(const QVector4D & point);
+    void clear();
+    int size() const;
+    Ray ray() const;
+
+private:
+    int n;
+    double mean[3];
+    double scatter[9];
+    QVector4D first, last;
+};
+
 class Plane
 {
 public:
@@ -42,18 +66,141 @@ private:
 
 };
 
+// Cost of one stage of a calibration solve, the solver counters stay 0 for closed-form stages
+struct SolveStage
+{
+    SolveStage() : time(0.0), niter(0), nfev(0), status(0), orignorm(0.0), bestnorm(0.0) {}
+
+    QString name;
+    double time;            // wall time in ms
+    int niter;
+    int nfev;
+    int status;
+    double orignorm;
+    double bestnorm;
+};
+
+// Deadline, cancellation (from any thread) and telemetry of a calibration solve, its fits stop once it expired
+class SolverControl : public QObject, public LMMonitor
+{
+    Q_OBJECT
+public:
+    // deadline in ms from now, negative for none
+    explicit SolverControl(qint64 deadline = -1, QObject * parent = 0);
+
+    void cancel();
+    bool isCancelled() const;
+    bool expired() const;
+
+    virtual bool iteration(int iter, double chi2);
+
+    // appends a stage that started when timer was started to the telemetry of the solve, with the counters of result if not null
+    void record(const QString & stage, const QElapsedTimer & timer, const LMResult * result = NULL);
+    QVector<SolveStage> telemetry() const;
+
+signals:
+    // emitted from the solving thread after every iteration of a fit
+    void progress(int iteration, double chi2);
+
+private:
+    QAtomicInt cancelled;
+    QElapsedTimer timer;
+    qint64 deadline;
+
+    mutable QMutex mutex;
+    QVector<SolveStage> stages;
+};
+
+// Point/marker pairs of a fit, one array per coordinate, weighted by the inverse point spreads scaled to RMS 1
 struct ErrorFuncPointData{
-    QVector<QVector4D> points;
-    QVector<QVector4D> markers;
+    ErrorFuncPointData(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const QVector<double> & spreads = QVector<double>());
+    int size() const;
+    double weight(int i) const;
+
+    QVector<double> px, py, pz;
+    QVector<double> mx, my, mz;
+    QVector<double> w;      // empty for an unweighted fit
 };
 
+// MPFIT residual function of the parameters {rotX, rotY, rotZ, tX, tY, tZ, scaleX, scaleY}, vars is an ErrorFuncPointData
+int errorFunc(int m, int n, double *p, double *deviates, double **derivs, void *vars);
+
+// LEVMAR and MPFIT fit Euler angles, LEVMAR_ROTATION_VECTOR a rotation vector converted back to them
+enum SolverType{LEVMAR, MPFIT, LEVMAR_ROTATION_VECTOR};
+
 QMatrix4x4 createTransformationMatrix(float alpha, float beta, float gamma, QVector3D translationVector, QVector3D scalingVector);
-void getInitialEstimates(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, QVector3D & rotation, QVector3D & translation, float & scale);
-QMatrix4x4 computeTransformationMatrixFromPoints(const QVector<QVector4D> & points, const QVector<QVector4D> & markers);
+void getInitialEstimates(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, QVector3D & rotation, QVector3D & translation, QVector2D & scale);
+// workspace (MPFIT only) reuses the solver buffers across calls, parameters receives the fitted x[] if not null
+QMatrix4x4 computeTransformationMatrixFromPoints(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, SolverType solver = LEVMAR, mp_workspace * workspace = NULL, double * parameters = NULL,
+                                                 SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>());
+// Parameter vector x[] = {rotX, rotY, rotZ, tX, tY, tZ, scaleX, scaleY} of createTransformationMatrix from the closed-form estimate
+void getInitialParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double x[8]);
+// Closed-form plane and homography (DLT) fit of four or more pairs, false if the points or the markers are collinear
+bool computeHomographyMatrix(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, QMatrix4x4 & M);
+// x[] of getInitialParameters from the homography linearized at the centroid of the points, false like computeHomographyMatrix
+bool getHomographyParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double x[8]);
+// Refines x[] in place from its current value, returns the RMS screen error in marker units
+double refineTransformationParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double x[8], int maxIterations = 100, SolverControl * control = NULL,
+                                      const QVector<double> & spreads = QVector<double>(), SolverType solver = LEVMAR);
+// Refines seeds around the closed-form estimate in parallel for at most timeBudget ms and keeps the lowest chi^2
+QMatrix4x4 computeTransformationMatrixMultiStart(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int seeds, int timeBudget, SolverType solver = LEVMAR, double * parameters = NULL,
+                                                 SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>());
+
+// RANSAC labelling, pairs within threshold (marker units) of their markers under the refit with solver to the largest consensus set
+QVector<bool> findTransformationInliers(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, double threshold, int maxHypotheses = 1000, SolverControl * control = NULL,
+                                        SolverType solver = LEVMAR);
 
 void getScreenPlaneInitialEstimates(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, QVector3D & point, QVector3D & normal, float & scale);
 QMatrix4x4 computeScreenPlaneFromPoints(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, QVector3D & point, QVector3D & normal);
 
-QVector4D  computeProjectorPosition(const QVector<Ray> & rays);
+// Point closest to all rays, false if they are parallel (or fewer than two) and there is no single closest point
+bool computeProjectorPosition(const QVector<Ray> & rays, QVector4D & position, int iterations = 0);
+
+// Joint fit of x[] and the projector position to taps consecutive taps per marker, returns the RMS screen error in marker units
+double refineProjectiveParameters(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, double x[8], QVector4D & projectorPosition, int maxIterations = 100,
+                                  SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>());
+
+const int ERROR_MAP_SIZE = 5;
+
+// Uncertainty of a calibration, from the covariance of the fit or from bootstrapSamples > 1 parallel refits
+struct CalibrationUncertainty
+{
+    CalibrationUncertainty() : bootstrapSamples(0) {}
+
+    int bootstrapSamples;               // 0 if the covariance of the fit was used
+    QVector<double> parameters;         // standard deviation of every fitted parameter, empty if unknown
+    QVector<QVector3D> errorMap;        // screen x, y and predicted standard deviation on a grid over the markers
+};
+
+// uncertainty of x[] fitted by refineTransformationParameters, the error map includes a correction grid of correctionGridSize
+CalibrationUncertainty computeTransformationUncertainty(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8], int bootstrapSamples = 0,
+                                                        SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>(), int correctionGridSize = 0,
+                                                        SolverType solver = LEVMAR);
+// uncertainty of x[] and the projector position fitted by refineProjectiveParameters, in this order
+CalibrationUncertainty computeProjectiveUncertainty(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, const double x[8], const QVector4D & projectorPosition,
+                                                    int bootstrapSamples = 0, SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>(),
+                                                    int correctionGridSize = 0);
+
+// Leave-one-out RMS screen error of every marker, refitted like the fit, -1 for skipped folds and empty below 4 markers
+QVector<double> crossValidateTransformation(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8], SolverControl * control = NULL,
+                                            const QVector<double> & spreads = QVector<double>(), int correctionGridSize = 0, SolverType solver = LEVMAR);
+QVector<double> crossValidateProjective(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, int taps, const double x[8], const QVector4D & projectorPosition,
+                                        SolverControl * control = NULL, const QVector<double> & spreads = QVector<double>(), int correctionGridSize = 0);
+
+// Screen offsets on a size x size grid spanning the markers, interpolated bilinearly, node (i, j) at 2 * (j * size + i)
+struct CorrectionGrid
+{
+    CorrectionGrid() : size(0), x0(0.0f), y0(0.0f), x1(0.0f), y1(0.0f) {}
+
+    bool isEmpty() const { return size < 2; }
+    QVector2D correct(const QVector2D & position) const;
+
+    int size;
+    float x0, y0, x1, y1;       // screen area spanned by the nodes
+    QVector<float> offsets;
+};
+
+// Smoothed correction grid through the residuals marker - position, empty for fewer than 4 pairs
+CorrectionGrid fitCorrectionGrid(const QVector<QVector2D> & positions, const QVector<QVector2D> & residuals, int size);
 
 #endif // CALIBRATIONTOOLS_H
@@ -1,8 +1,9 @@
 #include "collector.h"
 
+#include <cmath>
+
 #define FAST_MOVEMENT_SPEED 35.0f
 #define SLOW_MOVEMENT_SPEED 1.5f
-#define MAX_POSITIONS 15
 
 PointCollector::PointCollector(QObject *parent)
     :QObject(parent), goal(0), state(FAST_MOVEMENT_EXPECTED)
@@ -19,9 +20,35 @@ QVector<QVector4D> PointCollector::getPoints()
     return points;
 }
 
+QVector<double> PointCollector::getSpreads()
+{
+    return spreads;
+}
+
+QVector4D PointCollector::fingerPoint(const QVector<QVector3D> & positions, double & spread)
+{
+    // get median position
+    QVector<float> xs, ys, zs;
+    foreach(QVector3D position, positions){
+        xs << position.x(); ys << position.y(); zs << position.z();
+    }
+
+    qSort(xs);qSort(ys);qSort(zs);
+    QVector4D fingerPosition(xs[xs.size()/2], ys[ys.size()/2], zs[zs.size()/2], 1.0f);
+
+    // RMS distance of the samples from the median, the median of n samples has a standard error of about 1.25 / sqrt(n) of it
+    double variance = 0.0;
+    foreach(QVector3D position, positions)
+        variance += (position - fingerPosition.toVector3D()).lengthSquared() / positions.size();
+
+    spread = 1.2533 * sqrt(variance / positions.size());
+    return fingerPosition;
+}
+
 void PointCollector::restart()
 {
     points.clear();
+    spreads.clear();
     state = FAST_MOVEMENT_EXPECTED;
 }
 
@@ -63,17 +90,12 @@ void PointCollector::processFrame()
             if(fingerPositions.size() < MAX_POSITIONS){
                 fingerPositions.append(QVector3D(tipPosition.x, tipPosition.y, tipPosition.z));
             }else{
-                // get median position
-                QVector<float> xs, ys, zs;
-                foreach(QVector3D position, fingerPositions){
-                    xs << position.x(); ys << position.y(); zs << position.z();
-                }
-
-                qSort(xs);qSort(ys);qSort(zs);
-                QVector4D fingerPosition(xs[xs.size()/2], ys[ys.size()/2], zs[zs.size()/2], 1.0f);
+                double spread;
+                QVector4D fingerPosition = fingerPoint(fingerPositions, spread);
 
                 state = FAST_MOVEMENT_EXPECTED;
                 points.append(fingerPosition);
+                spreads.append(spread);
                 emit collected();
 
                 fingerPositions.clear();
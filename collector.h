@@ -9,6 +9,9 @@
 
 
 
+// finger positions sampled for every point, their median is the point
+#define MAX_POSITIONS 15
+
 class PointCollector : public QObject
 {
     Q_OBJECT
@@ -17,6 +20,11 @@ public:
     explicit PointCollector(QObject *parent = 0);
     void setGoal(int goal);
     QVector<QVector4D> getPoints();
+    // standard error of every point in mm, estimated from the spread of the samples behind its median
+    QVector<double> getSpreads();
+
+    // median of the positions sampled for one point and the standard error of the median in mm
+    static QVector4D fingerPoint(const QVector<QVector3D> & positions, double & spread);
 
 signals:
     void finished();
@@ -39,6 +47,7 @@ private:
     Leap::Controller controller;
     QVector<QVector3D> fingerPositions;
     QVector<QVector4D> points;
+    QVector<double> spreads;
 };
 
 #endif // COLLECTOR_H
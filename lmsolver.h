@@ -0,0 +1,276 @@
+#ifndef LMSOLVER_H
+#define LMSOLVER_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "mpfit/mpfit.h"
+
+// Levenberg-Marquardt solver for least-squares problems with a small, fixed number of parameters.
+//
+// All work arrays are sized by template parameters and live on the stack, the residual functor
+// is a template parameter, so its calls can be inlined. The functor provides
+//
+//   enum { PARAMETERS = n, RESIDUALS = m };
+//   int size() const;                                                  number of residual blocks
+//   void prepare(const double * p);                                    called once for every parameter vector
+//   void evaluate(int i, double * r, double (*J)[PARAMETERS]) const;   m residuals of block i and, if J is
+//                                                                      not null, their m x n derivatives
+//   void update(const double * p, const double * delta, double * pnew) const;
+//                                                                      applies a step, pnew = p + delta for
+//                                                                      plain parameters; J is the derivative
+//                                                                      with respect to delta at delta = 0
+//
+// The normal equations are accumulated block by block, so no m x n Jacobian is ever stored.
+// Status codes and counters follow mpfit (see mp_result).
+
+// status of a solve ended by its monitor, x holds the best parameters found so far
+#define LM_STOPPED (9)
+
+// Watches a running solve and may stop it
+class LMMonitor
+{
+public:
+    virtual ~LMMonitor() {}
+
+    // called after every iteration with the chi^2 of the current parameters, returning false stops the solve
+    virtual bool iteration(int iter, double chi2) = 0;
+};
+
+struct LMResult
+{
+    double bestnorm;     // final chi^2
+    double orignorm;     // starting chi^2
+    int niter;           // number of iterations
+    int nfev;            // number of residual evaluations
+    int status;          // MP_OK_CHI, MP_OK_PAR, MP_OK_BOTH, MP_OK_DIR, MP_MAXITER, MP_XTOL or LM_STOPPED
+};
+
+template<class F>
+class LMSolver
+{
+public:
+    enum { N = F::PARAMETERS, M = F::RESIDUALS };
+
+    LMSolver()
+        :maxIterations(200), ftol(1e-10), xtol(1e-10), gtol(1e-10), monitor(0)
+    {
+    }
+
+    int solve(F & f, double * x, LMResult * result = 0) const
+    {
+        double JtJ[N][N], Jtr[N], A[N][N], delta[N], xnew[N];
+        int nfev = 0, iter = 0, status = 0;
+
+        double chi2 = normalEquations(f, x, JtJ, Jtr);
+        double orignorm = chi2;
+        nfev++;
+
+        // damping is relative to the diagonal of J^T J (Marquardt scaling)
+        double lambda = 1e-3;
+        double nu = 2.0;
+
+        while(!status){
+            if(iter >= maxIterations){
+                status = MP_MAXITER;
+                break;
+            }
+            iter++;
+
+            // gradient orthogonal to the residuals
+            double gnorm = 0.0;
+            for(int k = 0; k < N; k++)
+                if(JtJ[k][k] > 0.0 && chi2 > 0.0)
+                    gnorm = std::max(gnorm, std::fabs(Jtr[k]) / std::sqrt(JtJ[k][k] * chi2));
+            if(gnorm <= gtol){
+                status = MP_OK_DIR;
+                break;
+            }
+
+            // damped normal equations with Marquardt scaling
+            for(int k = 0; k < N; k++){
+                for(int l = 0; l < N; l++)
+                    A[k][l] = JtJ[k][l];
+                A[k][k] += lambda * std::max(JtJ[k][k], 1e-12);
+            }
+
+            if(!cholesky(A, Jtr, delta)){
+                lambda *= nu;
+                nu *= 2.0;
+                continue;
+            }
+
+            double xnorm = 0.0, dnorm = 0.0;
+            for(int k = 0; k < N; k++){
+                delta[k] = -delta[k];
+                xnorm += x[k] * x[k];
+                dnorm += delta[k] * delta[k];
+            }
+            f.update(x, delta, xnew);
+
+            // reduction predicted by the linear model
+            double predicted = 0.0;
+            for(int k = 0; k < N; k++){
+                double JtJdelta = 0.0;
+                for(int l = 0; l < N; l++)
+                    JtJdelta += JtJ[k][l] * delta[l];
+                predicted -= delta[k] * (2.0 * Jtr[k] + JtJdelta);
+            }
+
+            double chi2new = cost(f, xnew);
+            nfev++;
+
+            // relative actual and predicted reductions, tested for accepted and rejected steps as in mpfit,
+            // so a minimum that is only resolved to rounding error still ends the iteration
+            double actred = chi2 > 0.0 ? (chi2 - chi2new) / chi2 : 0.0;
+            double prered = chi2 > 0.0 ? predicted / chi2 : 0.0;
+            double ratio = predicted > 0.0 ? (chi2 - chi2new) / predicted : -1.0;
+
+            if(std::fabs(actred) <= ftol && prered <= ftol && ratio <= 2.0)
+                status = MP_OK_CHI;
+
+            if(ratio > 0.0){
+                for(int k = 0; k < N; k++)
+                    x[k] = xnew[k];
+                chi2 = normalEquations(f, x, JtJ, Jtr);
+                nfev++;
+
+                double t = 2.0 * ratio - 1.0;
+                lambda *= std::max(1.0 / 3.0, 1.0 - t * t * t);
+                nu = 2.0;
+
+                if(std::sqrt(dnorm) <= xtol * (std::sqrt(xnorm) + xtol))
+                    status = status == MP_OK_CHI ? MP_OK_BOTH : MP_OK_PAR;
+            }else{
+                lambda *= nu;
+                nu *= 2.0;
+
+                // the damping has shrunk the step below the resolution of x
+                if(!status && std::sqrt(dnorm) <= DBL_EPSILON * std::sqrt(xnorm))
+                    status = MP_XTOL;
+            }
+
+            if(!status && monitor && !monitor->iteration(iter, chi2))
+                status = LM_STOPPED;
+        }
+
+        if(result){
+            result->bestnorm = chi2;
+            result->orignorm = orignorm;
+            result->niter = iter;
+            result->nfev = nfev;
+            result->status = status;
+        }
+        return status;
+    }
+
+    // unscaled covariance (J^T J)^-1 at x, scale it by chi^2 / (m - n) for the covariance of the fitted parameters,
+    // returns false if J^T J is singular
+    bool covariance(F & f, const double * x, double C[N][N]) const
+    {
+        double JtJ[N][N], Jtr[N], A[N][N], e[N], column[N];
+        normalEquations(f, x, JtJ, Jtr);
+
+        for(int j = 0; j < N; j++){
+            for(int k = 0; k < N; k++){
+                for(int l = 0; l < N; l++)
+                    A[k][l] = JtJ[k][l];
+                e[k] = k == j ? 1.0 : 0.0;
+            }
+            if(!cholesky(A, e, column))
+                return false;
+            for(int k = 0; k < N; k++)
+                C[k][j] = column[k];
+        }
+        return true;
+    }
+
+    int maxIterations;
+    double ftol;
+    double xtol;
+    double gtol;
+    LMMonitor * monitor;    // optional, asked to continue after every iteration
+
+private:
+    static double cost(F & f, const double * x)
+    {
+        double r[M];
+        double chi2 = 0.0;
+
+        f.prepare(x);
+        for(int i = 0, n = f.size(); i < n; i++){
+            f.evaluate(i, r, 0);
+            for(int k = 0; k < M; k++)
+                chi2 += r[k] * r[k];
+        }
+        return chi2;
+    }
+
+    static double normalEquations(F & f, const double * x, double JtJ[N][N], double Jtr[N])
+    {
+        double r[M], J[M][N];
+        double chi2 = 0.0;
+
+        for(int k = 0; k < N; k++){
+            Jtr[k] = 0.0;
+            for(int l = 0; l < N; l++)
+                JtJ[k][l] = 0.0;
+        }
+
+        f.prepare(x);
+        for(int i = 0, n = f.size(); i < n; i++){
+            f.evaluate(i, r, J);
+            for(int j = 0; j < M; j++){
+                chi2 += r[j] * r[j];
+                for(int k = 0; k < N; k++){
+                    Jtr[k] += J[j][k] * r[j];
+                    for(int l = k; l < N; l++)
+                        JtJ[k][l] += J[j][k] * J[j][l];
+                }
+            }
+        }
+
+        for(int k = 0; k < N; k++)
+            for(int l = 0; l < k; l++)
+                JtJ[k][l] = JtJ[l][k];
+
+        return chi2;
+    }
+
+    // solves A x = b for symmetric positive definite A, A is overwritten by its Cholesky factor
+    static bool cholesky(double A[N][N], const double b[N], double x[N])
+    {
+        for(int j = 0; j < N; j++){
+            double d = A[j][j];
+            for(int k = 0; k < j; k++)
+                d -= A[j][k] * A[j][k];
+            if(d <= 0.0)
+                return false;
+            A[j][j] = std::sqrt(d);
+
+            for(int i = j + 1; i < N; i++){
+                double s = A[i][j];
+                for(int k = 0; k < j; k++)
+                    s -= A[i][k] * A[j][k];
+                A[i][j] = s / A[j][j];
+            }
+        }
+
+        for(int i = 0; i < N; i++){
+            double s = b[i];
+            for(int k = 0; k < i; k++)
+                s -= A[i][k] * x[k];
+            x[i] = s / A[i][i];
+        }
+        for(int i = N - 1; i >= 0; i--){
+            double s = x[i];
+            for(int k = i + 1; k < N; k++)
+                s -= A[k][i] * x[k];
+            x[i] = s / A[i][i];
+        }
+        return true;
+    }
+};
+
+#endif // LMSOLVER_H
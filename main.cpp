@@ -1,6 +1,8 @@
 #include <QApplication>
 #include <QCommandLineParser>
 #include <QCommandLineOption>
+#include <QScopedPointer>
+#include <QThread>
 
 #include <QMenu>
 #include <QSystemTrayIcon>
@@ -11,10 +13,21 @@
 
 #include "screencalibration.h"
 #include "calibrationserver.h"
+#include "calibrationbenchmark.h"
 
 int main(int argc, char *argv[])
 {
-    QApplication a(argc, argv);
+    // the benchmarks need no display, so they run without the GUI, the options may be given as --name value or --name=value
+    bool benchmark = false, latencyBenchmark = false;
+    for(int i = 1; i < argc; i++){
+        QString argument(argv[i]);
+        if(argument == "--benchmark" || argument.startsWith("--benchmark="))
+            benchmark = true;
+        if(argument == "--latency-benchmark" || argument.startsWith("--latency-benchmark="))
+            latencyBenchmark = true;
+    }
+
+    QScopedPointer<QCoreApplication> a(benchmark || latencyBenchmark ? new QCoreApplication(argc, argv) : new QApplication(argc, argv));
 
     QApplication::setApplicationName(QString(argv[0]));
     QApplication::setApplicationVersion("0.1");
@@ -29,7 +42,66 @@ int main(int argc, char *argv[])
     QCommandLineOption portOption(QStringList() << "p" << "port", "Port on which the server will listen.", "port", "8889");
     parser.addOption(portOption);
 
-    parser.process(a);
+    QCommandLineOption noDelayOption(QStringList() << "nodelay", "Disable Nagle's algorithm on client connections.");
+    parser.addOption(noDelayOption);
+
+    QCommandLineOption sendBufferOption(QStringList() << "sndbuf", "Socket send buffer size in bytes.", "bytes");
+    parser.addOption(sendBufferOption);
+
+    QCommandLineOption receiveBufferOption(QStringList() << "rcvbuf", "Socket receive buffer size in bytes.", "bytes");
+    parser.addOption(receiveBufferOption);
+
+    QCommandLineOption cpuOption(QStringList() << "cpu", "Pin the server thread to the given CPU.", "cpu");
+    parser.addOption(cpuOption);
+
+    QCommandLineOption solverOption(QStringList() << "solver", "Solver of the screen transformation: euler (Euler angles), rotation-vector or mpfit.", "solver", "euler");
+    parser.addOption(solverOption);
+
+    QCommandLineOption multiStartOption(QStringList() << "multistart", "Refine the calibration from the given number of seeds in parallel.", "seeds");
+    parser.addOption(multiStartOption);
+
+    QCommandLineOption budgetOption(QStringList() << "budget", "Time budget of the multi-start search in milliseconds.", "ms", "200");
+    parser.addOption(budgetOption);
+
+    QCommandLineOption rejectOutliersOption(QStringList() << "reject-outliers", "Leave calibration taps that a robust rigid fit maps far from their marker out of the calibration, "
+                                                                                    "not applied to 2D calibrations with --homography or with --correction-grid.");
+    parser.addOption(rejectOutliersOption);
+
+    QCommandLineOption inlierThresholdOption(QStringList() << "inlier-threshold", "Distance in pixels from their marker beyond which --reject-outliers rejects taps.", "pixels",
+                                             QString::number(DEFAULT_INLIER_THRESHOLD));
+    parser.addOption(inlierThresholdOption);
+
+    QCommandLineOption bootstrapOption(QStringList() << "bootstrap", "Estimate the calibration uncertainty from the given number of bootstrap refits instead of the fit covariance.", "samples", "0");
+    parser.addOption(bootstrapOption);
+
+    QCommandLineOption deadlineOption(QStringList() << "deadline", "Stop a calibration after the given number of milliseconds and apply the best parameters found so far, 0 for no deadline.", "ms", "0");
+    parser.addOption(deadlineOption);
+
+    QCommandLineOption homographyOption(QStringList() << "homography", "Fit 2D calibrations with a plane and a homography in closed form, which also corrects keystone.");
+    parser.addOption(homographyOption);
+
+    QCommandLineOption homographyStartOption(QStringList() << "homography-start", "Start the rigid 2D transformation fit from the homography instead of the closed-form estimate.");
+    parser.addOption(homographyStartOption);
+
+    QCommandLineOption correctionGridOption(QStringList() << "correction-grid", "Correct the residuals left at the markers with a grid of the given number of nodes per side, 0 disables the correction.", "nodes", "0");
+    parser.addOption(correctionGridOption);
+
+    QCommandLineOption telemetryLogOption(QStringList() << "telemetry-log", "Append the solver telemetry of every calibration to the given file, no log by default.", "file");
+    parser.addOption(telemetryLogOption);
+
+    QCommandLineOption benchmarkOption(QStringList() << "benchmark", "Solve the given number of synthetic calibrations per configuration with the calibration settings, print their errors and solve times and exit.", "trials");
+    parser.addOption(benchmarkOption);
+
+    QCommandLineOption latencyBenchmarkOption(QStringList() << "latency-benchmark", "Send the given number of touch requests to the server over loopback one after another with Nagle's algorithm on and off, default and --sndbuf/--rcvbuf buffers and without and with --cpu pinning, print the round trip times of each and exit.", "requests");
+    parser.addOption(latencyBenchmarkOption);
+
+    QCommandLineOption benchmarkBaselineOption(QStringList() << "benchmark-baseline", "Fail the benchmark if a configuration has larger pixel errors, more evaluations or more failures than in the given results file.", "file");
+    parser.addOption(benchmarkBaselineOption);
+
+    QCommandLineOption benchmarkOutputOption(QStringList() << "benchmark-output", "Save the benchmark results to the given file, to be used as a baseline.", "file");
+    parser.addOption(benchmarkOutputOption);
+
+    parser.process(*a);
 
     bool ok;
     int portNum = parser.value(portOption).toInt(&ok);
@@ -38,11 +110,135 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    int sendBufferSize = 0;
+    if(parser.isSet(sendBufferOption)){
+        sendBufferSize = parser.value(sendBufferOption).toInt(&ok);
+        if(!ok || sendBufferSize <= 0){
+            std::cerr << "ERROR: Send buffer size has to be a positive number." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    int receiveBufferSize = 0;
+    if(parser.isSet(receiveBufferOption)){
+        receiveBufferSize = parser.value(receiveBufferOption).toInt(&ok);
+        if(!ok || receiveBufferSize <= 0){
+            std::cerr << "ERROR: Receive buffer size has to be a positive number." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    int cpu = -1;
+    if(parser.isSet(cpuOption)){
+        cpu = parser.value(cpuOption).toInt(&ok);
+        if(!ok || cpu < 0 || cpu >= QThread::idealThreadCount()){
+            std::cerr << "ERROR: CPU number has to be between 0 and " << QThread::idealThreadCount() - 1 << "." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    SolverType solver;
+    QString solverName = parser.value(solverOption);
+    if(solverName == "euler"){
+        solver = LEVMAR;
+    }else if(solverName == "rotation-vector"){
+        solver = LEVMAR_ROTATION_VECTOR;
+    }else if(solverName == "mpfit"){
+        solver = MPFIT;
+    }else{
+        std::cerr << "ERROR: Solver has to be euler, rotation-vector or mpfit." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int multiStartSeeds = 0;
+    if(parser.isSet(multiStartOption)){
+        multiStartSeeds = parser.value(multiStartOption).toInt(&ok);
+        if(!ok || multiStartSeeds <= 0){
+            std::cerr << "ERROR: Number of seeds has to be a positive number." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    int multiStartBudget = parser.value(budgetOption).toInt(&ok);
+    if(!ok || multiStartBudget <= 0){
+        std::cerr << "ERROR: Time budget has to be a positive number." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double inlierThreshold = parser.value(inlierThresholdOption).toDouble(&ok);
+    if(!ok || inlierThreshold <= 0.0){
+        std::cerr << "ERROR: Inlier threshold has to be a positive number." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int bootstrapSamples = parser.value(bootstrapOption).toInt(&ok);
+    if(!ok || bootstrapSamples < 0 || bootstrapSamples == 1){
+        std::cerr << "ERROR: Number of bootstrap samples has to be 0 or at least 2." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int solveDeadline = parser.value(deadlineOption).toInt(&ok);
+    if(!ok || solveDeadline < 0){
+        std::cerr << "ERROR: Calibration deadline has to be a non-negative number of milliseconds." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int correctionGridSize = parser.value(correctionGridOption).toInt(&ok);
+    if(!ok || correctionGridSize < 0 || correctionGridSize == 1 || correctionGridSize > 16){
+        std::cerr << "ERROR: Correction grid size has to be 0 or between 2 and 16." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int benchmarkTrials = 0;
+    if(benchmark){
+        benchmarkTrials = parser.value(benchmarkOption).toInt(&ok);
+        if(!ok || benchmarkTrials <= 0){
+            std::cerr << "ERROR: Number of benchmark trials has to be positive." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    int latencyRequests = 0;
+    if(latencyBenchmark){
+        latencyRequests = parser.value(latencyBenchmarkOption).toInt(&ok);
+        if(!ok || latencyRequests <= 0){
+            std::cerr << "ERROR: Number of latency benchmark requests has to be positive." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     QString port = parser.value(portOption);
 
+    // the latency benchmark compares the socket options with their defaults on servers of its own
+    if(latencyBenchmark)
+        return runLatencyBenchmark(latencyRequests, sendBufferSize, receiveBufferSize, cpu) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // the benchmark solves synthetic calibrations, which must not replace the stored one, it solves them without
+    // finishing a calibration job, so nothing reaches the telemetry log either
+    CalibrationServer s(benchmark ? QString() : QString("s.dat"));
+    s.setSolver(solver);
+    s.setMultiStart(multiStartSeeds, multiStartBudget);
+    s.setInlierThreshold(parser.isSet(rejectOutliersOption) ? inlierThreshold : 0.0);
+    s.setBootstrap(bootstrapSamples);
+    s.setSolveDeadline(solveDeadline);
+    s.setHomography(parser.isSet(homographyOption), parser.isSet(homographyStartOption));
+    s.setCorrectionGrid(correctionGridSize);
+    s.setTelemetryLog(parser.value(telemetryLogOption));
+
+    // tune server sockets, the options are applied when the server starts listening
+    s.setLowDelay(parser.isSet(noDelayOption));
+    s.setSendBufferSize(sendBufferSize);
+    s.setReceiveBufferSize(receiveBufferSize);
+
+    if(cpu >= 0 && !s.setCpuAffinity(cpu))
+        std::cerr << "WARNING: Could not pin server thread to CPU " << cpu << std::endl;
+
+    if(benchmark)
+        return runCalibrationBenchmark(s, benchmarkTrials, parser.value(benchmarkBaselineOption), parser.value(benchmarkOutputOption)) == 0
+                ? EXIT_SUCCESS : EXIT_FAILURE;
+
     // start server
-    CalibrationServer s;
-    if(s.listen(QHostAddress::LocalHost, portNum)){
+    if(s.listenTuned(QHostAddress::LocalHost, portNum)){
         std::cout << "INFO: Server is listening on port " << s.serverPort() << std::endl;
     } else{
         std::cerr << "ERROR: Server could not start listening on port " << portNum << std::endl;
@@ -70,7 +266,7 @@ int main(int argc, char *argv[])
     QObject::connect(&signalMapper, SIGNAL(mapped(int)), &c, SLOT(startCalibration(int)));
 
     QAction * quitAction = trayMenu.addAction("Quit");
-    QObject::connect(quitAction, SIGNAL(triggered()), &a, SLOT(quit()));
+    QObject::connect(quitAction, SIGNAL(triggered()), a.data(), SLOT(quit()));
 
 
     QSystemTrayIcon trayIcon;
@@ -78,5 +274,5 @@ int main(int argc, char *argv[])
     trayIcon.setContextMenu(&trayMenu);
     trayIcon.show();
 
-    return a.exec();
+    return a->exec();
 }
@@ -22,6 +22,10 @@
 #include <string.h>
 #include "mpfit.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /* Forward declarations of functions in this module */
 static int mp_fdjac2(mp_func funct,
 	      int m, int n, int *ifree, int npar, double *x, double *fvec,
@@ -29,7 +33,11 @@ static int mp_fdjac2(mp_func funct,
 	      double *wa, void *priv, int *nfev,
 	      double *step, double *dstep, int *dside,
 	      int *qulimited, double *ulimit,
-	      int *ddebug, double *ddrtol, double *ddatol);
+	      int *ddebug, double *ddrtol, double *ddatol, double **dvec,
+	      int nthreads, double *twa);
+static double mp_fdstep(double temp, double eps, int j, int *ifree,
+	      double *step, double *dstep, int *dside,
+	      int *qulimited, double *ulimit);
 static void mp_qrfac(int m, int n, double *a, int lda, 
 	      int pivot, int *ipvt, int lipvt,
 	      double *rdiag, double *acnorm, double *wa);
@@ -43,17 +51,16 @@ static double mp_dmax1(double a, double b);
 static double mp_dmin1(double a, double b);
 static int mp_min0(int a, int b);
 static int mp_covar(int n, double *r, int ldr, int *ipvt, double tol, double *wa);
+static int mp_workspace_reserve(mp_workspace *ws, int ndbuf, int nibuf, int npbuf);
 
 /* Macro to call user function */
 #define mp_call(funct, m, n, x, fvec, dvec, priv) (*(funct))(m,n,x,fvec,dvec,priv)
 
-/* Macro to safely allocate memory */
-#define mp_malloc(dest,type,size) \
-  dest = (type *) malloc( sizeof(type)*size ); \
-  if (dest == 0) { \
-    info = MP_ERR_MEMORY; \
-    goto CLEANUP; \
-  } else { \
+/* Macro to take zeroed memory from the workspace pools (int or double) */
+#define mp_take(dest,type,size) \
+  dest = type##pool; \
+  type##pool += (size); \
+  { \
     int _k; \
     for (_k=0; _k<(size); _k++) dest[_k] = 0; \
   } 
@@ -271,8 +278,18 @@ static int mp_covar(int n, double *r, int ldr, int *ipvt, double tol, double *wa
 int mpfit(mp_func funct, int m, int npar,
 	  double *xall, mp_par *pars, mp_config *config, void *private_data, 
 	  mp_result *result)
+{
+  return mpfit_ws(funct, m, npar, xall, pars, config, private_data, result, 0);
+}
+
+int mpfit_ws(mp_func funct, int m, int npar,
+	     double *xall, mp_par *pars, mp_config *config, void *private_data, 
+	     mp_result *result, mp_workspace *ws)
 {
   mp_config conf;
+  mp_workspace tmpws;
+  double *doublepool = 0;
+  int *intpool = 0;
   int i, j, info, iflag, nfree, npegged, iter;
   int qanylim = 0, qanypegged = 0;
 
@@ -297,6 +314,7 @@ int mpfit(mp_func funct, int m, int npar,
   double *fvec = 0, *qtf = 0;
   double *x = 0, *xnew = 0, *fjac = 0, *diag = 0;
   double *wa1 = 0, *wa2 = 0, *wa3 = 0, *wa4 = 0;
+  double *twa = 0;
   int *ipvt = 0;
 
   int ldfjac;
@@ -313,6 +331,7 @@ int mpfit(mp_func funct, int m, int npar,
   conf.maxfev = 0;
   conf.covtol = 1e-14;
   conf.nofinitecheck = 0;
+  conf.nthreads = 1;
   
   if (config) {
     /* Transfer any user-specified configurations */
@@ -326,6 +345,7 @@ int mpfit(mp_func funct, int m, int npar,
     if (config->douserscale != 0) conf.douserscale = config->douserscale;
     if (config->covtol > 0) conf.covtol = config->covtol;
     if (config->nofinitecheck > 0) conf.nofinitecheck = config->nofinitecheck;
+    if (config->nthreads > 0) conf.nthreads = config->nthreads;
     conf.maxfev = config->maxfev;
   }
 
@@ -351,19 +371,38 @@ int mpfit(mp_func funct, int m, int npar,
   xnorm = -1.0;
   delta = 0.0;
 
+  if (ws == 0) {
+    mp_workspace_init(&tmpws);
+    ws = &tmpws;
+  }
+#ifndef _OPENMP
+  conf.nthreads = 1;
+#endif
+  if (conf.nthreads > 1 && npar < conf.nthreads) conf.nthreads = npar;
+
+  /* Temporary storage, sized for the case that all parameters are free,
+     plus a copy of x and fvec for every Jacobian thread */
+  if (mp_workspace_reserve(ws, 13*npar + 2*m + m*npar + ((conf.nthreads > 1)?(conf.nthreads*(m+npar)):(0)),
+			   7*npar, npar)) {
+    info = MP_ERR_MEMORY;
+    goto CLEANUP;
+  }
+  doublepool = ws->dbuf;
+  intpool = ws->ibuf;
+
   /* FIXED parameters? */
-  mp_malloc(pfixed, int, npar);
+  mp_take(pfixed, int, npar);
   if (pars) for (i=0; i<npar; i++) {
     pfixed[i] = (pars[i].fixed)?1:0;
   }
 
   /* Finite differencing step, absolute and relative, and sidedness of deriv */
-  mp_malloc(step,  double, npar);
-  mp_malloc(dstep, double, npar);
-  mp_malloc(mpside, int, npar);
-  mp_malloc(ddebug, int, npar);
-  mp_malloc(ddrtol, double, npar);
-  mp_malloc(ddatol, double, npar);
+  mp_take(step,  double, npar);
+  mp_take(dstep, double, npar);
+  mp_take(mpside, int, npar);
+  mp_take(ddebug, int, npar);
+  mp_take(ddrtol, double, npar);
+  mp_take(ddatol, double, npar);
   if (pars) for (i=0; i<npar; i++) {
     step[i] = pars[i].step;
     dstep[i] = pars[i].relstep;
@@ -375,7 +414,7 @@ int mpfit(mp_func funct, int m, int npar,
     
   /* Finish up the free parameters */
   nfree = 0;
-  mp_malloc(ifree, int, npar);
+  mp_take(ifree, int, npar);
   for (i=0, j=0; i<npar; i++) {
     if (pfixed[i] == 0) {
       nfree++;
@@ -401,10 +440,10 @@ int mpfit(mp_func funct, int m, int npar,
       }
     }
 
-    mp_malloc(qulim, int, nfree);
-    mp_malloc(qllim, int, nfree);
-    mp_malloc(ulim, double, nfree);
-    mp_malloc(llim, double, nfree);
+    mp_take(qulim, int, nfree);
+    mp_take(qllim, int, nfree);
+    mp_take(ulim, double, nfree);
+    mp_take(llim, double, nfree);
 
     for (i=0; i<nfree; i++) {
       qllim[i] = pars[ifree[i]].limited[0];
@@ -430,18 +469,21 @@ int mpfit(mp_func funct, int m, int npar,
   }
 
   /* Allocate temporary storage */
-  mp_malloc(fvec, double, m);
-  mp_malloc(qtf, double, nfree);
-  mp_malloc(x, double, nfree);
-  mp_malloc(xnew, double, npar);
-  mp_malloc(fjac, double, m*nfree);
+  mp_take(fvec, double, m);
+  mp_take(qtf, double, nfree);
+  mp_take(x, double, nfree);
+  mp_take(xnew, double, npar);
+  mp_take(fjac, double, m*nfree);
   ldfjac = m;
-  mp_malloc(diag, double, npar);
-  mp_malloc(wa1, double, npar);
-  mp_malloc(wa2, double, npar);
-  mp_malloc(wa3, double, npar);
-  mp_malloc(wa4, double, m);
-  mp_malloc(ipvt, int, npar);
+  mp_take(diag, double, npar);
+  mp_take(wa1, double, npar);
+  mp_take(wa2, double, npar);
+  mp_take(wa3, double, npar);
+  mp_take(wa4, double, m);
+  mp_take(ipvt, int, npar);
+  if (conf.nthreads > 1) {
+    mp_take(twa, double, conf.nthreads*(m+npar));
+  }
 
   /* Evaluate user function with initial parameter values */
   iflag = mp_call(funct, m, npar, xall, fvec, 0, private_data);
@@ -483,7 +525,7 @@ int mpfit(mp_func funct, int m, int npar,
   iflag = mp_fdjac2(funct, m, nfree, ifree, npar, xnew, fvec, fjac, ldfjac,
 		    conf.epsfcn, wa4, private_data, &nfev,
 		    step, dstep, mpside, qulim, ulim,
-		    ddebug, ddrtol, ddatol);
+		    ddebug, ddrtol, ddatol, ws->pbuf, conf.nthreads, twa);
   if (iflag < 0) {
     goto CLEANUP;
   }
@@ -942,29 +984,7 @@ int mpfit(mp_func funct, int m, int npar,
 
 
  CLEANUP:
-  if (fvec) free(fvec);
-  if (qtf)  free(qtf);
-  if (x)    free(x);
-  if (xnew) free(xnew);
-  if (fjac) free(fjac);
-  if (diag) free(diag);
-  if (wa1)  free(wa1);
-  if (wa2)  free(wa2);
-  if (wa3)  free(wa3);
-  if (wa4)  free(wa4);
-  if (ipvt) free(ipvt);
-  if (pfixed) free(pfixed);
-  if (step) free(step);
-  if (dstep) free(dstep);
-  if (mpside) free(mpside);
-  if (ddebug) free(ddebug);
-  if (ddrtol) free(ddrtol);
-  if (ddatol) free(ddatol);
-  if (ifree) free(ifree);
-  if (qllim) free(qllim);
-  if (qulim) free(qulim);
-  if (llim)  free(llim);
-  if (ulim)  free(ulim);
+  if (ws == &tmpws) mp_workspace_free(&tmpws);
 
 
   return info;
@@ -980,7 +1000,8 @@ int mp_fdjac2(mp_func funct,
 	      double *wa, void *priv, int *nfev,
 	      double *step, double *dstep, int *dside,
 	      int *qulimited, double *ulimit,
-	      int *ddebug, double *ddrtol, double *ddatol)
+	      int *ddebug, double *ddrtol, double *ddatol, double **dvec,
+	      int nthreads, double *twa)
 {
 /*
 *     **********
@@ -1046,6 +1067,13 @@ int mp_fdjac2(mp_func funct,
 *
 *	wa is a work array of length m.
 *
+*	dvec is a work array of length npar.
+*
+*	nthreads is the number of threads for the numerical columns,
+*	  each thread uses npar+m elements of the work array twa.
+*	  the columns are only computed concurrently if none of
+*	  them is debugged.
+*
 *     subprograms called
 *
 *	user-supplied ...... fcn
@@ -1062,8 +1090,6 @@ int mp_fdjac2(mp_func funct,
   int i,j,ij;
   int iflag = 0;
   double eps,h,temp;
-  static double zero = 0.0;
-  double **dvec = 0;
   int has_analytical_deriv = 0, has_numerical_deriv = 0;
   int has_debug_deriv = 0;
   
@@ -1072,8 +1098,6 @@ int mp_fdjac2(mp_func funct,
   ij = 0;
   ldfjac = 0; /* Prevents compiler warning */
 
-  dvec = (double **) malloc(sizeof(double **)*npar);
-  if (dvec == 0) return MP_ERR_MEMORY;
   for (j=0; j<npar; j++) dvec[j] = 0;
 
   /* Initialize the Jacobian derivative matrix */
@@ -1111,6 +1135,62 @@ int mp_fdjac2(mp_func funct,
 	   "IPNT", "FUNC", "DERIV_U", "DERIV_N", "DIFF_ABS", "DIFF_REL");
   }
 
+#ifdef _OPENMP
+  /* Numerical derivatives, one column per thread at a time */
+  if (has_numerical_deriv && nthreads > 1 && !has_debug_deriv) {
+    int nev = 0;
+
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) private(i,temp,h) reduction(+:nev)
+    for (j=0; j<n; j++) {  /* Loop thru free parms */
+      int dsidei = (dside)?(dside[ifree[j]]):(0);
+      double *xt = twa + omp_get_thread_num()*(npar+m);
+      double *wt = xt + npar;
+      double *col = fjac + j*m;
+      int k, tflag;
+
+      if (dside && dsidei == 3) continue;
+
+      temp = x[ifree[j]];
+      h = mp_fdstep(temp, eps, j, ifree, step, dstep, dside, qulimited, ulimit);
+      for (k=0; k<npar; k++) xt[k] = x[k];
+
+      xt[ifree[j]] = temp + h;
+      tflag = mp_call(funct, m, npar, xt, wt, 0, priv);
+      nev++;
+      if (tflag < 0) {
+#pragma omp critical
+	iflag = tflag;
+	continue;
+      }
+
+      if (dsidei <= 1) {
+	/* COMPUTE THE ONE-SIDED DERIVATIVE */
+	for (i=0; i<m; i++) col[i] = (wt[i] - fvec[i])/h;
+      } else {
+	/* COMPUTE THE TWO-SIDED DERIVATIVE */
+	for (i=0; i<m; i++) col[i] = wt[i];
+
+	xt[ifree[j]] = temp - h;
+	tflag = mp_call(funct, m, npar, xt, wt, 0, priv);
+	nev++;
+	if (tflag < 0) {
+#pragma omp critical
+	  iflag = tflag;
+	  continue;
+	}
+
+	for (i=0; i<m; i++) col[i] = (col[i] - wt[i])/(2*h);
+      }
+    }
+
+    if (nfev) *nfev = *nfev + nev;
+    has_numerical_deriv = 0;
+  }
+#else
+  (void) nthreads;
+  (void) twa;
+#endif
+
   /* Any parameters requiring numerical derivatives */
   if (has_numerical_deriv) for (j=0; j<n; j++) {  /* Loop thru free parms */
     int dsidei = (dside)?(dside[ifree[j]]):(0);
@@ -1126,18 +1206,7 @@ int mp_fdjac2(mp_func funct,
     if (dside && dsidei == 3) continue;
 
     temp = x[ifree[j]];
-    h = eps * fabs(temp);
-    if (step  &&  step[ifree[j]] > 0) h = step[ifree[j]];
-    if (dstep && dstep[ifree[j]] > 0) h = fabs(dstep[ifree[j]]*temp);
-    if (h == zero)                    h = eps;
-
-    /* If negative step requested, or we are against the upper limit */
-    if ((dside && dsidei == -1) || 
-	(dside && dsidei == 0 && 
-	 qulimited && ulimit && qulimited[j] && 
-	 (temp > (ulimit[j]-h)))) {
-      h = -h;
-    }
+    h = mp_fdstep(temp, eps, j, ifree, step, dstep, dside, qulimited, ulimit);
 
     x[ifree[j]] = temp + h;
     iflag = mp_call(funct, m, npar, x, wa, 0, priv);
@@ -1206,7 +1275,6 @@ int mp_fdjac2(mp_func funct,
   }
 
  DONE:
-  if (dvec) free(dvec);
   if (iflag < 0) return iflag;
   return 0; 
   /*
@@ -1214,6 +1282,30 @@ int mp_fdjac2(mp_func funct,
    */
 }
 
+/* Finite difference step for free parameter j at value temp */
+static 
+double mp_fdstep(double temp, double eps, int j, int *ifree,
+		 double *step, double *dstep, int *dside,
+		 int *qulimited, double *ulimit)
+{
+  int dsidei = (dside)?(dside[ifree[j]]):(0);
+  double h;
+
+  h = eps * fabs(temp);
+  if (step  &&  step[ifree[j]] > 0) h = step[ifree[j]];
+  if (dstep && dstep[ifree[j]] > 0) h = fabs(dstep[ifree[j]]*temp);
+  if (h == 0)                       h = eps;
+
+  /* If negative step requested, or we are against the upper limit */
+  if ((dside && dsidei == -1) || 
+      (dside && dsidei == 0 && 
+       qulimited && ulimit && qulimited[j] && 
+       (temp > (ulimit[j]-h)))) {
+    h = -h;
+  }
+  return h;
+}
+
 
 /************************qrfac.c*************************/
  
@@ -2290,3 +2382,51 @@ int mp_covar(int n, double *r, int ldr, int *ipvt, double tol, double *wa)
 
   return 0;
 }
+
+
+/************************workspace.c*************************/
+
+void mp_workspace_init(mp_workspace *ws)
+{
+  ws->dbuf = 0;
+  ws->ndbuf = 0;
+  ws->ibuf = 0;
+  ws->nibuf = 0;
+  ws->pbuf = 0;
+  ws->npbuf = 0;
+}
+
+void mp_workspace_free(mp_workspace *ws)
+{
+  if (ws->dbuf) free(ws->dbuf);
+  if (ws->ibuf) free(ws->ibuf);
+  if (ws->pbuf) free(ws->pbuf);
+  mp_workspace_init(ws);
+}
+
+/* Grows the workspace buffers to at least the requested sizes; the
+   contents are not preserved.  Returns 0 or MP_ERR_MEMORY. */
+static 
+int mp_workspace_reserve(mp_workspace *ws, int ndbuf, int nibuf, int npbuf)
+{
+  if (ws->ndbuf < ndbuf) {
+    if (ws->dbuf) free(ws->dbuf);
+    ws->dbuf = (double *) malloc(sizeof(double)*ndbuf);
+    ws->ndbuf = (ws->dbuf)?(ndbuf):(0);
+  }
+  if (ws->nibuf < nibuf) {
+    if (ws->ibuf) free(ws->ibuf);
+    ws->ibuf = (int *) malloc(sizeof(int)*nibuf);
+    ws->nibuf = (ws->ibuf)?(nibuf):(0);
+  }
+  if (ws->npbuf < npbuf) {
+    if (ws->pbuf) free(ws->pbuf);
+    ws->pbuf = (double **) malloc(sizeof(double *)*npbuf);
+    ws->npbuf = (ws->pbuf)?(npbuf):(0);
+  }
+
+  if (ws->ndbuf < ndbuf || ws->nibuf < nibuf || ws->npbuf < npbuf) {
+    return MP_ERR_MEMORY;
+  }
+  return 0;
+}
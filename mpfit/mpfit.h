@@ -92,6 +92,11 @@ struct mp_config_struct {
 		     */
   mp_iterproc iterproc; /* Placeholder pointer - must set to 0 */
 
+  int nthreads;   /* Number of threads evaluating the columns of a
+		     finite-difference Jacobian concurrently.  Values
+		     <= 1 evaluate them serially; only has an effect
+		     when compiled with OpenMP and the user function
+		     is thread-safe (see mp_func).  Default: 1 */
 };
 
 /* Definition of results structure, for when fit completes */
@@ -116,12 +121,36 @@ struct mp_result_struct {
   char version[20];    /* MPFIT version string */
 };  
 
+/* Definition of workspace structure, holding the temporary arrays of
+   a fit.  Passing the same workspace to consecutive calls of
+   mpfit_ws() reuses its buffers; they only grow when a larger problem
+   comes along, so repeated fits of the same size do not allocate
+   memory at all.  Initialize with mp_workspace_init() (or zero all
+   fields) and release with mp_workspace_free().  A workspace must not
+   be used by two fits at the same time. */
+struct mp_workspace_struct {
+  double *dbuf;        /* double precision storage */
+  int ndbuf;           /* capacity of dbuf, in elements */
+  int *ibuf;           /* integer storage */
+  int nibuf;           /* capacity of ibuf, in elements */
+  double **pbuf;       /* derivative column pointers */
+  int npbuf;           /* capacity of pbuf, in elements */
+};
+
 /* Convenience typedefs */  
 typedef struct mp_par_struct mp_par;
 typedef struct mp_config_struct mp_config;
 typedef struct mp_result_struct mp_result;
+typedef struct mp_workspace_struct mp_workspace;
 
-/* Enforce type of fitting function */
+/* Enforce type of fitting function.
+
+   Thread safety: with mp_config.nthreads > 1 the function is called
+   concurrently from several threads while a Jacobian is computed by
+   finite differences.  Every call gets its own x and fvec, but
+   private_data is shared, so the function must only read it (or
+   synchronize any writes itself).  Analytical derivatives (dvec) are
+   always requested from the calling thread. */
 typedef int (*mp_func)(int m, /* Number of functions (elts of fvec) */
 		       int n, /* Number of variables (elts of x) */
 		       double *x,      /* I - Parameters */
@@ -175,6 +204,16 @@ extern int mpfit(mp_func funct, int m, int npar,
 		 void *private_data, 
 		 mp_result *result);
 
+/* Same as mpfit(), with the temporary arrays taken from ws.  If ws is
+   0 a temporary workspace is allocated and freed again, which is what
+   mpfit() does. */
+extern int mpfit_ws(mp_func funct, int m, int npar,
+		    double *xall, mp_par *pars, mp_config *config, 
+		    void *private_data, 
+		    mp_result *result, mp_workspace *ws);
+
+extern void mp_workspace_init(mp_workspace *ws);
+extern void mp_workspace_free(mp_workspace *ws);
 
 
 /* C99 uses isfinite() instead of finite() */
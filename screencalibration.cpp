@@ -4,12 +4,13 @@
 
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QDebug>
 
 #include "screencalibration.h"
 
 ScreenCalibration::ScreenCalibration(QWidget *parent) :
     QWidget(parent), state(IDLE), pattern(NULL), collector(NULL), timer(NULL),
-    markerRadius(25), patternSize(2)
+    markerRadius(25), patternSize(2), provisionalMarkers(0), provisionalError(0.0), provisionalHeldOut(false), quickCalibration(false)
 {
     setWindowIcon(QIcon(":icons/app.ico"));
 }
@@ -39,22 +40,24 @@ ScreenCalibration::~ScreenCalibration()
     delete collector;
 }
 
-void ScreenCalibration::calibrate()
+void ScreenCalibration::calibrate(bool quick)
 {
     state = CALIBRATION2D;
+    quickCalibration = quick;
+    int gridSize = quick ? 2 : patternSize;
 
     // create calibration pattern
     if(pattern)
         delete pattern;
     pattern = new CalibrationPattern;
-    pattern->distributeMarkers(this->size(), patternSize * patternSize, markerRadius);
+    pattern->distributeMarkers(this->size(), gridSize * gridSize, markerRadius);
     pattern->activateFirst();
 
     // create collector
     if(collector)
         delete collector;
     collector = new PointCollector;
-    collector->setGoal(patternSize * patternSize);
+    collector->setGoal(gridSize * gridSize);
 
     // start timer (disconnect all previously connected signals)
     if(timer)
@@ -65,29 +68,34 @@ void ScreenCalibration::calibrate()
     // connect signals to slots
     connect(timer, SIGNAL(timeout()), collector, SLOT(processFrame()));
     connect(timer, SIGNAL(timeout()), this, SLOT(update()));
+    connect(collector, SIGNAL(collected()), this, SLOT(streamPoint()));
     connect(collector, SIGNAL(collected()), pattern, SLOT(activateNext()));
     connect(collector, SIGNAL(finished()), this, SLOT(finishCalibration()));
 
+    provisionalMarkers = 0;
+
     // start calibration
     timer->start();
 }
 
-void ScreenCalibration::calibrate3D()
+void ScreenCalibration::calibrate3D(bool quick)
 {
     state = CALIBRATION3D;
+    quickCalibration = quick;
+    int gridSize = quick ? 2 : patternSize;
 
     // create calibration pattern
     if(pattern)
         delete pattern;
     pattern = new Pattern3D(3);
-    pattern->distributeMarkers(this->size(), patternSize * patternSize, markerRadius);
+    pattern->distributeMarkers(this->size(), gridSize * gridSize, markerRadius);
     pattern->activateFirst();
 
     // create collector
     if(collector)
         delete collector;
     collector = new PointCollector;
-    collector->setGoal(3 * patternSize * patternSize);
+    collector->setGoal(3 * gridSize * gridSize);
 
     // start timer (disconnect all previously connected signals)
     if(timer)
@@ -98,9 +106,12 @@ void ScreenCalibration::calibrate3D()
     // connect signals to slots
     connect(timer, SIGNAL(timeout()), collector, SLOT(processFrame()));
     connect(timer, SIGNAL(timeout()), this, SLOT(update()));
+    connect(collector, SIGNAL(collected()), this, SLOT(streamPoint()));
     connect(collector, SIGNAL(collected()), pattern, SLOT(activateNext()));
     connect(collector, SIGNAL(finished()), this, SLOT(finishCalibration()));
 
+    provisionalMarkers = 0;
+
     // start calibration
     timer->start();
 }
@@ -127,6 +138,8 @@ void ScreenCalibration::paintEvent(QPaintEvent * /*event*/)
         drawPattern(&painter);
     if(state == CALIBRATION3D)
         drawPattern3D(&painter);
+    if(state == CALIBRATION2D || state == CALIBRATION3D)
+        drawProvisionalError(&painter);
     if(state == TESTING)
         drawCursor(&painter);
 }
@@ -200,6 +213,17 @@ void ScreenCalibration::drawPattern3D(QPainter *painter)
     }
 }
 
+void ScreenCalibration::drawProvisionalError(QPainter *painter)
+{
+    if(provisionalMarkers < 3)
+        return;
+
+    painter->setPen(Qt::black);
+    painter->drawText(rect().adjusted(10, 10, -10, -10), Qt::AlignBottom | Qt::AlignHCenter,
+                      QString("Provisional %1 %2 px on %3 markers, press Enter to finish now").arg(provisionalHeldOut ? "held-out error" : "residual")
+                      .arg(provisionalError, 0, 'f', 1).arg(provisionalMarkers));
+}
+
 void ScreenCalibration::drawCursor(QPainter *painter)
 {
     if(calibrationData.T == NONE)
@@ -261,10 +285,18 @@ void ScreenCalibration::keyPressEvent(QKeyEvent *event)
         this->hide();
         break;
     case Qt::Key_Delete:
+        // a calibration still being solved on the server is dropped along with the taps
+        serverSocket.sendTextMessage(createCancelRequest());
         if(state == CALIBRATION3D)
-            calibrate3D();
+            calibrate3D(quickCalibration);
         else
-            calibrate();
+            calibrate(quickCalibration);
+        break;
+    case Qt::Key_Return:
+    case Qt::Key_Enter:
+        // stop early with the markers tapped so far once the provisional fit is good enough for the user
+        if((state == CALIBRATION2D || state == CALIBRATION3D) && provisionalMarkers >= 3)
+            finishCalibration();
         break;
     case Qt::Key_1:
         calibrate();
@@ -275,6 +307,15 @@ void ScreenCalibration::keyPressEvent(QKeyEvent *event)
     case Qt::Key_3:
         test();
         break;
+    case Qt::Key_4:
+        // without a stored solution there is nothing to refine
+        if(calibrationData.P.size() != 8)
+            break;
+        if(calibrationData.T == C3D)
+            calibrate3D(true);
+        else
+            calibrate(true);
+        break;
     case Qt::Key_Plus:
         if(state != CALIBRATION2D && state != CALIBRATION3D)
             break;
@@ -335,7 +376,12 @@ void ScreenCalibration::finishCalibration()
 {   
     timer->stop();
 
-    serverSocket.sendTextMessage(createCalibRequest(state == CALIBRATION2D ? C2D: C3D, collector->getPoints(), pattern->getMarkerPositions()));
+    // after an early stop only the markers with all their taps are sent
+    int taps = state == CALIBRATION3D ? static_cast<Pattern3D *>(pattern)->getDepth() : 1;
+    int markers = qMin(collector->getPoints().size() / taps, pattern->getMarkerPositions().size());
+
+    serverSocket.sendTextMessage(createCalibRequest(state == CALIBRATION2D ? C2D: C3D, collector->getPoints().mid(0, markers * taps), pattern->getMarkerPositions().mid(0, markers), quickCalibration,
+                                                    collector->getSpreads().mid(0, markers * taps)));
 
     delete pattern;
     pattern = NULL;
@@ -345,14 +391,79 @@ void ScreenCalibration::finishCalibration()
     test();
 }
 
+void ScreenCalibration::streamPoint()
+{
+    QVector<QVector4D> points = collector->getPoints();
+    if(points.isEmpty())
+        return;
+
+    int index = points.size() - 1;
+    int marker = state == CALIBRATION3D ? index / static_cast<Pattern3D *>(pattern)->getDepth() : index;
+    QVector<QVector4D> markers = pattern->getMarkerPositions();
+    if(marker >= markers.size())
+        return;
+
+    serverSocket.sendTextMessage(createStreamRequest(state == CALIBRATION2D ? C2D: C3D, index, marker, points[index], markers[marker]));
+}
+
 void ScreenCalibration::onConnected()
 {
+    // cursor responses arrive in bursts of three, let the server send them in one frame
+    serverSocket.sendTextMessage(createBatchRequest(true));
 }
 
 void ScreenCalibration::processTextMessage(const QString & message)
 {
     QVector4D intersectionPoint;
-    if(parseCalibResponse(message, calibrationData)){
+    QStringList messages;
+    int progressIteration;
+    double progressChi2;
+    if(parseBatchMessage(message, messages)){
+        foreach(QString m, messages)
+            processTextMessage(m);
+    } else if(parseCalibResponse(message, calibrationData)){
+        QVector<int> rejectedMarkers;
+        if(parseRejectedMarkers(message, rejectedMarkers)){
+            QStringList markerList;
+            foreach(int marker, rejectedMarkers)
+                markerList << QString::number(marker);
+            qWarning() << "WARNING: Taps on markers" << markerList.join(", ") << "were rejected as outliers.";
+        }
+
+        CalibrationUncertainty uncertainty;
+        if(parseCalibUncertainty(message, uncertainty) && !uncertainty.errorMap.isEmpty()){
+            double maxError = 0.0, meanError2 = 0.0;
+            foreach(QVector3D error, uncertainty.errorMap){
+                maxError = qMax(maxError, double(error.z()));
+                meanError2 += error.z() * error.z() / uncertainty.errorMap.size();
+            }
+            qDebug() << "INFO: Predicted screen error" << sqrt(meanError2) << "px RMS," << maxError << "px at worst"
+                     << (uncertainty.bootstrapSamples > 0 ? QString("(%1 bootstrap samples)").arg(uncertainty.bootstrapSamples) : QString("(fit covariance)"));
+        }
+
+        QMap<int, double> heldOutErrors;
+        if(parseHeldOutErrors(message, heldOutErrors) && !heldOutErrors.isEmpty()){
+            QStringList errorList;
+            QMap<int, double>::const_iterator it;
+            for(it = heldOutErrors.constBegin(); it != heldOutErrors.constEnd(); ++it)
+                errorList << QString("%1: %2").arg(it.key()).arg(it.value(), 0, 'f', 1);
+            qDebug() << "INFO: Held-out error per marker (px)" << errorList.join(", ");
+        }
+
+        QVector<SolveStage> telemetry;
+        if(parseSolveTelemetry(message, telemetry) && !telemetry.isEmpty()){
+            QStringList stageList;
+            double total = 0.0;
+            foreach(SolveStage stage, telemetry){
+                stageList << QString("%1 %2 ms").arg(stage.name).arg(stage.time, 0, 'f', 1) + (stage.nfev > 0 ? QString(" (%1 iterations, %2 evaluations)").arg(stage.niter).arg(stage.nfev) : QString());
+                total += stage.time;
+            }
+            qDebug() << "INFO: Solved in" << total << "ms:" << stageList.join(", ");
+        }
+    } else if(parseProvisionalResponse(message, provisionalMarkers, provisionalError, provisionalHeldOut)){
+        update();
+    } else if(parseProgressResponse(message, progressIteration, progressChi2)){
+        qDebug() << "INFO: Solving calibration, iteration" << progressIteration << "chi2" << progressChi2;
     } else if(parseTouchResponse(message, intersectionPoint)){
         touchCursor = intersectionPoint.toVector2D();
     } else if(parsePointResponse(message, intersectionPoint)){
@@ -47,8 +47,16 @@ private:
     int markerRadius;
     int patternSize;
 
-    void calibrate();
-    void calibrate3D();
+    // accuracy of the server's provisional fit to the points streamed so far, the held-out error or the residual
+    int provisionalMarkers;
+    double provisionalError;
+    bool provisionalHeldOut;
+
+    // quick calibrations tap a 2x2 grid and refine the stored solution
+    bool quickCalibration;
+
+    void calibrate(bool quick = false);
+    void calibrate3D(bool quick = false);
     void test();
 
 protected:
@@ -56,6 +64,7 @@ protected:
     virtual void drawPattern(QPainter * painter);
     virtual void drawPattern3D(QPainter * painter);
     virtual void drawCursor(QPainter * painter);
+    virtual void drawProvisionalError(QPainter * painter);
     virtual void keyPressEvent(QKeyEvent * event);
 
 signals:
@@ -63,6 +72,7 @@ signals:
 public slots:
     void startCalibration(int);
     void finishCalibration();
+    void streamPoint();
 
     void onConnected();
     void processTextMessage(const QString &);
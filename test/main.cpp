@@ -0,0 +1,557 @@
+// Checks of the calibration math. The residual functors are local to calibrationtools.cpp, so it is included here
+// rather than linked. Every check prints its worst deviation, the program fails if any exceeds its tolerance.
+// The behaviour checks run on the synthetic calibrations of the benchmark.
+
+#include "../calibrationtools.cpp"
+#include "../calibrationbenchmark.h"
+
+#include <cstdio>
+#include <limits>
+
+static int failures = 0;
+
+// xorshift, the same sequence on every platform
+static quint32 state = 1;
+
+static double uniform(double a, double b)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return a + (b - a) * (state / 4294967296.0);
+}
+
+static void report(const char * name, double deviation, double tolerance)
+{
+    bool passed = deviation <= tolerance;
+    printf("%-56s %12.3g %s\n", name, deviation, passed ? "ok" : "FAILED");
+    if(!passed)
+        failures++;
+}
+
+// n random points within reach of the Leap, markers on the screen and, if weighted, the spreads of the taps
+static ErrorFuncPointData randomData(int n, bool weighted)
+{
+    QVector<QVector4D> points, markers;
+    QVector<double> spreads;
+    for(int i = 0; i < n; i++){
+        points << QVector4D(uniform(-200.0, 200.0), uniform(50.0, 400.0), uniform(-200.0, 200.0), 1.0f);
+        markers << QVector4D(uniform(0.0, 1920.0), uniform(0.0, 1080.0), 0.0f, 1.0f);
+        if(weighted)
+            spreads << uniform(0.0, 5.0);
+    }
+    return ErrorFuncPointData(points, markers, spreads);
+}
+
+// screen transformation parameters away from the gimbal lock of the Euler angles
+static void randomTransformation(double x[8])
+{
+    x[0] = uniform(-M_PI, M_PI);
+    x[1] = uniform(-1.4, 1.4);
+    x[2] = uniform(-M_PI, M_PI);
+    for(int k = 3; k < 6; k++)
+        x[k] = uniform(-300.0, 300.0);
+    x[6] = uniform(1.5, 4.0);
+    x[7] = uniform(1.5, 4.0);
+}
+
+// largest difference between a Jacobian column and its central difference, relative to the size of the column
+static double columnDeviation(const double * analytic, const double * plus, const double * minus, double h, int m)
+{
+    double deviation = 0.0, size = 1.0;
+    for(int i = 0; i < m; i++){
+        double numeric = (plus[i] - minus[i]) / (2.0 * h);
+        deviation = std::max(deviation, std::fabs(analytic[i] - numeric));
+        size = std::max(size, std::fabs(numeric));
+    }
+    return deviation / size;
+}
+
+// step of the central difference for a parameter of the given size
+static double step(double p)
+{
+    return 1e-6 * std::max(1.0, std::fabs(p));
+}
+
+// all residuals of F at p and, if J is not null, their derivatives, column l of residual j at J[l * m + j]
+template<class F>
+static void evaluateAll(F & f, const double * p, double * r, double * J)
+{
+    const int m = f.size() * F::RESIDUALS;
+    f.prepare(p);
+    for(int i = 0; i < f.size(); i++){
+        double Ji[F::RESIDUALS][F::PARAMETERS];
+        f.evaluate(i, r + i * F::RESIDUALS, J ? Ji : NULL);
+        for(int k = 0; J && k < F::RESIDUALS; k++)
+            for(int l = 0; l < F::PARAMETERS; l++)
+                J[l * m + i * F::RESIDUALS + k] = Ji[k][l];
+    }
+}
+
+// The derivatives of an LMSolver functor are taken with respect to the step its update() applies
+template<class F>
+static double functorDeviation(F & f, const double * p)
+{
+    const int n = F::PARAMETERS, m = f.size() * F::RESIDUALS;
+    QVector<double> r(m), J(n * m), plus(m), minus(m);
+    evaluateAll(f, p, r.data(), J.data());
+
+    double deviation = 0.0;
+    for(int l = 0; l < n; l++){
+        double delta[F::PARAMETERS] = {0.0}, q[F::PARAMETERS];
+        double h = step(p[l]);
+
+        delta[l] = h;
+        f.update(p, delta, q);
+        evaluateAll(f, q, plus.data(), NULL);
+
+        delta[l] = -h;
+        f.update(p, delta, q);
+        evaluateAll(f, q, minus.data(), NULL);
+
+        deviation = std::max(deviation, columnDeviation(J.data() + l * m, plus.data(), minus.data(), h, m));
+    }
+    return deviation;
+}
+
+static double errorFuncDeviation(ErrorFuncPointData & data, const double * x)
+{
+    const int m = data.size() * 3;
+    QVector<double> r(m), J(8 * m), plus(m), minus(m);
+    double p[8];
+    std::copy(x, x + 8, p);
+
+    double * derivs[8];
+    for(int l = 0; l < 8; l++)
+        derivs[l] = J.data() + l * m;
+    errorFunc(m, 8, p, r.data(), derivs, &data);
+
+    double deviation = 0.0;
+    for(int l = 0; l < 8; l++){
+        double h = step(x[l]);
+
+        p[l] = x[l] + h;
+        errorFunc(m, 8, p, plus.data(), NULL, &data);
+        p[l] = x[l] - h;
+        errorFunc(m, 8, p, minus.data(), NULL, &data);
+        p[l] = x[l];
+
+        deviation = std::max(deviation, columnDeviation(derivs[l], plus.data(), minus.data(), h, m));
+    }
+    return deviation;
+}
+
+// every analytic Jacobian against central differences at random parameters, with and without tap weights
+static void testJacobians()
+{
+    static const int POINTS = 9;
+    static const int TRIALS = 200;
+    static const double TOLERANCE = 1e-6;
+
+    for(int weighted = 0; weighted < 2; weighted++){
+        double errorFuncWorst = 0.0, transformationWorst = 0.0, rotationVectorWorst = 0.0, projectiveWorst = 0.0;
+
+        for(int trial = 0; trial < TRIALS; trial++){
+            ErrorFuncPointData data = randomData(POINTS, weighted);
+            double x[8];
+            randomTransformation(x);
+
+            errorFuncWorst = std::max(errorFuncWorst, errorFuncDeviation(data, x));
+
+            TransformationResidual transformation(data);
+            transformationWorst = std::max(transformationWorst, functorDeviation(transformation, x));
+
+            double w[8];
+            std::copy(x, x + 8, w);
+            double R[3][3], dR[3][3][3];
+            rotationMatrix(x[0], x[1], x[2], R, dR);
+            matrixToRotationVector(R, w);
+            RotationVectorResidual rotationVector(data);
+            rotationVectorWorst = std::max(rotationVectorWorst, functorDeviation(rotationVector, w));
+
+            // the projector 1 to 2.5 m in front of the screen in screen coordinates, so no tap is projected
+            // from the plane of the projector, v = t + R^T c
+            double c[3] = {uniform(-500.0, 500.0), uniform(-500.0, 500.0), uniform(1000.0, 2500.0)};
+            double p[ProjectiveResidual::PARAMETERS];
+            std::copy(x, x + 8, p);
+            for(int k = 0; k < 3; k++)
+                p[8 + k] = x[3 + k] + R[0][k]*c[0] + R[1][k]*c[1] + R[2][k]*c[2];
+            ProjectiveResidual projective(data, 3);
+            projectiveWorst = std::max(projectiveWorst, functorDeviation(projective, p));
+        }
+
+        const char * suffix = weighted ? ", weighted" : "";
+        report(qPrintable(QString("errorFunc Jacobian%1").arg(suffix)), errorFuncWorst, TOLERANCE);
+        report(qPrintable(QString("TransformationResidual Jacobian%1").arg(suffix)), transformationWorst, TOLERANCE);
+        report(qPrintable(QString("RotationVectorResidual Jacobian%1").arg(suffix)), rotationVectorWorst, TOLERANCE);
+        report(qPrintable(QString("ProjectiveResidual Jacobian%1").arg(suffix)), projectiveWorst, TOLERANCE);
+    }
+}
+
+// gridSize x gridSize markers and the points that a screen with parameters x maps onto them, with noise of about
+// the given standard deviation in mm, p = t + R^T S^-1 marker
+static void randomCalibration(const double x[8], int gridSize, double noise, QVector<QVector4D> & points, QVector<QVector4D> & markers)
+{
+    double R[3][3], dR[3][3][3];
+    rotationMatrix(x[0], x[1], x[2], R, dR);
+
+    for(int j = 0; j < gridSize; j++){
+        for(int i = 0; i < gridSize; i++){
+            double m[3] = {(i + 0.5) * 1920.0 / gridSize, (j + 0.5) * 1080.0 / gridSize, 0.0};
+            double q[3] = {m[0] / x[6], m[1] / x[7], m[2]};
+
+            // the sum of three uniform numbers has the variance of one
+            double p[3];
+            for(int k = 0; k < 3; k++)
+                p[k] = x[3 + k] + R[0][k]*q[0] + R[1][k]*q[1] + R[2][k]*q[2]
+                     + noise * (uniform(-1.0, 1.0) + uniform(-1.0, 1.0) + uniform(-1.0, 1.0));
+
+            points << QVector4D(p[0], p[1], p[2], 1.0f);
+            markers << QVector4D(m[0], m[1], m[2], 1.0f);
+        }
+    }
+}
+
+// LMSolver against mpfit on the same fits, both from the closed-form estimate: they have to reach the same chi^2
+// and map the points to the same screen positions, and LMSolver has to stop well before its iteration limit
+static void testSolvers()
+{
+    static const int TRIALS = 300;
+    static const double CHI2_TOLERANCE = 1e-6;
+    static const double POSITION_TOLERANCE = 5e-3;
+    static const int ITERATION_LIMIT = 50;
+
+    double chi2Worst = 0.0, positionWorst = 0.0, rotationVectorWorst = 0.0;
+    int iterationsWorst = 0;
+
+    for(int trial = 0; trial < TRIALS; trial++){
+        double truth[8];
+        randomTransformation(truth);
+
+        QVector<QVector4D> points, markers;
+        QVector<double> spreads;
+        randomCalibration(truth, 2 + trial % 4, 2.0, points, markers);
+        if(trial % 2)
+            for(int i = 0; i < points.size(); i++)
+                spreads << uniform(0.0, 5.0);
+        ErrorFuncPointData data(points, markers, spreads);
+
+        double start[8], mp[8], lm[8], rv[8];
+        getInitialParameters(points, markers, start);
+        std::copy(start, start + 8, mp);
+        std::copy(start, start + 8, lm);
+        std::copy(start, start + 8, rv);
+
+        LMResult mpResult, lmResult, rvResult;
+        refineTransformation(data, mp, MPFIT, NULL, 100000, NULL, &mpResult);
+        refineTransformation(data, lm, LEVMAR, NULL, 100000, NULL, &lmResult);
+        refineTransformation(data, rv, LEVMAR_ROTATION_VECTOR, NULL, 100000, NULL, &rvResult);
+
+        chi2Worst = std::max(chi2Worst, std::fabs(lmResult.bestnorm - mpResult.bestnorm) / std::max(mpResult.bestnorm, 1e-12));
+        rotationVectorWorst = std::max(rotationVectorWorst, std::fabs(rvResult.bestnorm - mpResult.bestnorm) / std::max(mpResult.bestnorm, 1e-12));
+        iterationsWorst = std::max(iterationsWorst, std::max(lmResult.niter, rvResult.niter));
+
+        // the unweighted residuals are the screen positions minus the markers
+        ErrorFuncPointData unweighted(points, markers);
+        const int m = 3 * unweighted.size();
+        QVector<double> mpPositions(m), lmPositions(m);
+        errorFunc(m, 8, mp, mpPositions.data(), NULL, &unweighted);
+        errorFunc(m, 8, lm, lmPositions.data(), NULL, &unweighted);
+        for(int i = 0; i < m; i++)
+            positionWorst = std::max(positionWorst, std::fabs(lmPositions[i] - mpPositions[i]));
+    }
+
+    report("LMSolver chi^2 against mpfit, relative", chi2Worst, CHI2_TOLERANCE);
+    report("LMSolver rotation vector chi^2 against mpfit, relative", rotationVectorWorst, CHI2_TOLERANCE);
+    report("LMSolver screen positions against mpfit, px", positionWorst, POSITION_TOLERANCE);
+    report("LMSolver iterations", iterationsWorst, ITERATION_LIMIT);
+}
+
+// RMS distance in px of the screen positions the transformation x maps the points to from their markers
+static double screenError(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8])
+{
+    ErrorFuncPointData data(points, markers);
+    QVector<double> ex(data.size()), ey(data.size());
+    screenErrors(data, x, ex.data(), ey.data());
+
+    double error2 = 0.0;
+    for(int i = 0; i < data.size(); i++)
+        error2 += ex[i]*ex[i] + ey[i]*ey[i];
+    return std::sqrt(error2 / data.size());
+}
+
+// The closed-form estimate has to put noise-free taps of random screens on their markers
+static void testInitialEstimate()
+{
+    static const int TRIALS = 100;
+    static const double TOLERANCE = 0.05;
+
+    CalibrationGenerator generator(1);
+    double worst = 0.0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C2D, 2 + trial % 3, 0.0);
+        double x[8];
+        getInitialParameters(c.points, c.markers, x);
+        worst = std::max(worst, screenError(c.points, c.markers, x));
+    }
+
+    report("closed-form estimate, noise-free, px", worst, TOLERANCE);
+}
+
+// The rays through the noise-free taps of every marker of a 3D calibration have to meet at the projector, parallel
+// rays have no closest point and have to be reported
+static void testProjectorPosition()
+{
+    static const int TRIALS = 100;
+    static const double TOLERANCE = 0.5;
+
+    CalibrationGenerator generator(2);
+    double worst = 0.0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C3D, 2 + trial % 3, 0.0);
+        int taps = c.points.size() / c.markers.size();
+
+        QVector<Ray> rays;
+        for(int i = 0; i < c.markers.size(); i++)
+            rays << Ray::fit(c.points.mid(i * taps, taps));
+
+        QVector4D position;
+        if(computeProjectorPosition(rays, position))
+            worst = std::max(worst, double((position - c.V).toVector3D().length()));
+        else
+            worst = std::numeric_limits<double>::infinity();
+    }
+    report("projector position, noise-free, mm", worst, TOLERANCE);
+
+    QVector<Ray> parallel;
+    parallel << Ray(QVector4D(0.0f, 0.0f, 0.0f, 1.0f), QVector4D(0.0f, 0.0f, 1.0f, 0.0f))
+             << Ray(QVector4D(100.0f, 0.0f, 0.0f, 1.0f), QVector4D(0.0f, 0.0f, 1.0f, 0.0f))
+             << Ray(QVector4D(0.0f, 100.0f, 50.0f, 1.0f), QVector4D(0.0f, 0.0f, -1.0f, 0.0f));
+    QVector4D position;
+    report("projector position of parallel rays found", computeProjectorPosition(parallel, position) ? 1.0 : 0.0, 0.0);
+}
+
+// The rays fitted to the taps of every marker, one accumulator cleared between the markers, have to pass through the
+// surface point and the projector and point from the first tap to the last, towards the projector
+static void testRayAccumulator()
+{
+    static const int TRIALS = 100;
+    static const double TOLERANCE = 0.01;
+
+    CalibrationGenerator generator(3);
+    double worst = 0.0;
+    int reversed = 0;
+    RayAccumulator accumulator;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C3D, 3, 0.0);
+        int taps = c.points.size() / c.markers.size();
+
+        for(int i = 0; i < c.markers.size(); i++){
+            accumulator.clear();
+            for(int j = 0; j < taps; j++)
+                accumulator.add(c.points[i * taps + j]);
+
+            Ray ray = accumulator.ray();
+            QVector3D direction = ray.direction.toVector3D().normalized();
+            QVector3D toProjector = (c.V - ray.origin).toVector3D(), toSurface = (c.surfacePoint(c.markers[i]) - ray.origin).toVector3D();
+            worst = std::max(worst, double(QVector3D::crossProduct(direction, toProjector.normalized()).length()));
+            worst = std::max(worst, double(QVector3D::crossProduct(direction, toSurface).length()));
+            if(QVector3D::dotProduct(direction, toProjector) < 0.0f)
+                reversed++;
+        }
+    }
+
+    report("RayAccumulator off the taps' line, noise-free, mm", worst, TOLERANCE);
+    report("RayAccumulator rays against the tap order", reversed, 0.0);
+}
+
+// Taps moved far from their markers have to be labelled outliers by the RANSAC search and all the others inliers
+static void testInliers()
+{
+    static const int TRIALS = 50;
+    static const int OUTLIERS = 3;
+
+    CalibrationGenerator generator(4);
+    int mislabelled = 0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C2D, 4, 0.5);
+
+        // the taps of a few markers land where other screen positions are, 180 px away
+        QVector<bool> outlier(c.markers.size(), false);
+        for(int k = 0; k < OUTLIERS; k++){
+            int i = (trial + 5 * k) % c.markers.size();
+            outlier[i] = true;
+            c.points[i] = c.surfacePoint(c.markers[i] + QVector4D(150.0f, -100.0f, 0.0f, 0.0f));
+        }
+
+        QVector<bool> inliers = findTransformationInliers(c.points, c.markers, 50.0);
+        for(int i = 0; i < inliers.size(); i++)
+            if(inliers[i] == outlier[i])
+                mislabelled++;
+    }
+
+    report("RANSAC taps labelled wrongly", mislabelled, 0.0);
+}
+
+// A keystoned pattern is a homography of the screen plane, the closed-form homography has to reproduce it and
+// collinear markers determine none
+static void testHomography()
+{
+    static const int TRIALS = 100;
+    static const double TOLERANCE = 0.05;
+
+    CalibrationGenerator generator(5);
+    double worst = 0.0;
+    int collinear = 0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C2D, 3 + trial % 2, 0.0);
+
+        // a projector tilted up and sideways, the top of the image wider than the bottom
+        QMatrix4x4 keystone(1.0f, 0.05f, 0.0f, 0.0f,
+                            0.02f, 1.0f, 0.0f, 0.0f,
+                            0.0f, 0.0f, 1.0f, 0.0f,
+                            float(uniform(-1e-4, 1e-4)), float(uniform(-2e-4, 2e-4)), 0.0f, 1.0f);
+        QVector<QVector4D> keystoned;
+        foreach(QVector4D marker, c.markers){
+            QVector4D m = keystone * marker;
+            keystoned << QVector4D(m.x() / m.w(), m.y() / m.w(), 0.0f, 1.0f);
+        }
+
+        QMatrix4x4 M;
+        if(!computeHomographyMatrix(c.points, keystoned, M)){
+            worst = std::numeric_limits<double>::infinity();
+            continue;
+        }
+        for(int i = 0; i < c.points.size(); i++){
+            QVector4D m = M * c.points[i];
+            worst = std::max(worst, double((m.toVector2D() / m.w() - keystoned[i].toVector2D()).length()));
+        }
+
+        QVector<QVector4D> line;
+        for(int i = 0; i < 4; i++)
+            line << QVector4D(100.0f + 200.0f * i, 500.0f, 0.0f, 1.0f);
+        if(computeHomographyMatrix(c.points.mid(0, 4), line, M))
+            collinear++;
+    }
+
+    report("homography of a keystoned pattern, noise-free, px", worst, TOLERANCE);
+    report("homography of collinear markers found", collinear, 0.0);
+}
+
+// screen position moved outwards by a barrel distortion of up to about 50 px at the corners of a full HD screen
+static QVector4D barrel(const QVector4D & position)
+{
+    QVector2D d = position.toVector2D() - QVector2D(960.0f, 540.0f);
+    QVector2D m = position.toVector2D() + d * (1e-7f * d.lengthSquared());
+    return QVector4D(m.x(), m.y(), 0.0f, 1.0f);
+}
+
+// RMS of the residuals marker - position of the pairs under x left by grid, relative to those without it
+static double correctedFraction(const QVector<QVector4D> & points, const QVector<QVector4D> & markers, const double x[8], const CorrectionGrid & grid)
+{
+    QVector<QVector2D> positions, residuals;
+    correctionResiduals(ErrorFuncPointData(points, markers), 1, x, TransformationResidual::PARAMETERS, positions, residuals);
+
+    double before2 = 0.0, after2 = 0.0;
+    for(int i = 0; i < positions.size(); i++){
+        before2 += residuals[i].lengthSquared();
+        after2 += (grid.correct(positions[i]) - positions[i] - residuals[i]).lengthSquared();
+    }
+    return std::sqrt(after2 / before2);
+}
+
+// Markers displaced by a distortion the transformation cannot follow, the correction grid fitted to the residuals
+// has to remove a good part of them at the markers and must not add error between them, and fewer than 4 pairs
+// give no grid
+static void testCorrectionGrid()
+{
+    static const int TRIALS = 50;
+    static const double MARKER_TOLERANCE = 0.7;
+    static const double HELD_OUT_TOLERANCE = 0.95;
+    static const int HELD_OUT_GRID = 9;
+
+    CalibrationGenerator generator(6);
+    double markerWorst = 0.0, heldOutWorst = 0.0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C2D, 4, 0.0);
+
+        QVector<QVector4D> distorted;
+        foreach(QVector4D marker, c.markers)
+            distorted << barrel(marker);
+
+        double x[8];
+        getInitialParameters(c.points, distorted, x);
+        refineTransformationParameters(c.points, distorted, x);
+
+        QVector<QVector2D> positions, residuals;
+        correctionResiduals(ErrorFuncPointData(c.points, distorted), 1, x, TransformationResidual::PARAMETERS, positions, residuals);
+        CorrectionGrid grid = fitCorrectionGrid(positions, residuals, 4);
+        markerWorst = std::max(markerWorst, correctedFraction(c.points, distorted, x, grid));
+
+        // queries between the markers, within the area they span
+        QVector<QVector4D> queries, targets;
+        for(int j = 0; j < HELD_OUT_GRID; j++){
+            for(int i = 0; i < HELD_OUT_GRID; i++){
+                QVector4D q(300.0f + i * 1320.0f / (HELD_OUT_GRID - 1), 200.0f + j * 680.0f / (HELD_OUT_GRID - 1), 0.0f, 1.0f);
+                queries << c.surfacePoint(q);
+                targets << barrel(q);
+            }
+        }
+        heldOutWorst = std::max(heldOutWorst, correctedFraction(queries, targets, x, grid));
+    }
+    report("correction grid residuals left at markers, relative", markerWorst, MARKER_TOLERANCE);
+    report("correction grid residuals left between markers, relative", heldOutWorst, HELD_OUT_TOLERANCE);
+
+    QVector<QVector2D> positions, residuals;
+    positions << QVector2D(0.0f, 0.0f) << QVector2D(100.0f, 0.0f) << QVector2D(0.0f, 100.0f);
+    residuals << QVector2D(1.0f, 0.0f) << QVector2D(0.0f, 1.0f) << QVector2D(1.0f, 1.0f);
+    report("correction grid on 3 pairs fitted", fitCorrectionGrid(positions, residuals, 4).isEmpty() ? 0.0 : 1.0, 0.0);
+}
+
+// Four markers, three of them on a row: the fold holding out the fourth leaves a line and has to be skipped,
+// the others have to be refitted
+static void testCrossValidation()
+{
+    static const int TRIALS = 20;
+
+    CalibrationGenerator generator(7);
+    int mislabelled = 0;
+    for(int trial = 0; trial < TRIALS; trial++){
+        SyntheticCalibration c = generator.generate(C2D, 3, 0.5);
+
+        // the pattern runs in rows, the first three markers are the top row and the fifth is the centre
+        QVector<QVector4D> points, markers;
+        int chosen[4] = {0, 1, 2, 4};
+        for(int k = 0; k < 4; k++){
+            points << c.points[chosen[k]];
+            markers << c.markers[chosen[k]];
+        }
+
+        double x[8];
+        getInitialParameters(points, markers, x);
+        refineTransformationParameters(points, markers, x);
+
+        QVector<double> errors = crossValidateTransformation(points, markers, x);
+        for(int k = 0; k < 4; k++)
+            if(k >= errors.size() || (errors[k] < 0.0) != (k == 3))
+                mislabelled++;
+    }
+
+    report("cross-validation folds skipped wrongly", mislabelled, 0.0);
+}
+
+int main(int /*argc*/, char * /*argv*/[])
+{
+    testJacobians();
+    testSolvers();
+    testInitialEstimate();
+    testProjectorPosition();
+    testRayAccumulator();
+    testInliers();
+    testHomography();
+    testCorrectionGrid();
+    testCrossValidation();
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#-------------------------------------------------
+#
+# Checks of the calibration math that need no Leap
+# Motion and no display, run without arguments:
+#   test
+#
+#-------------------------------------------------
+
+QT       += core gui network websockets concurrent
+QT       -= widgets
+
+TARGET = test
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+# main.cpp includes ../calibrationtools.cpp to reach the residual functors
+# that are local to it, so it is not compiled separately. The behaviour
+# checks use the synthetic calibrations of the benchmark, which link the
+# server and the point collector (and with it the Leap SDK, though no
+# device is needed)
+SOURCES += main.cpp \
+    ../calibrationbenchmark.cpp \
+    ../calibrationserver.cpp \
+    ../calibrationdata.cpp \
+    ../calibrationpattern.cpp \
+    ../marker.cpp \
+    ../collector.cpp \
+    ../mpfit/mpfit.cpp
+
+HEADERS  += \
+    ../calibrationtools.h \
+    ../calibrationbenchmark.h \
+    ../calibrationserver.h \
+    ../calibrationdata.h \
+    ../calibrationpattern.h \
+    ../marker.h \
+    ../collector.h \
+    ../mpfit/mpfit.h \
+    ../lmsolver.h
+
+win32: LIBS += -lws2_32
+
+win32:CONFIG(release, debug|release): LIBS += -L$$(LEAP_SDK)/lib/x86/ -lLeap
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$(LEAP_SDK)/lib/x86/ -lLeapd
+else:unix: LIBS += -L$$(LEAP_SDK)/lib/x64/ -lLeap
+
+INCLUDEPATH += $$(LEAP_SDK)/include
+DEPENDPATH += $$(LEAP_SDK)/include